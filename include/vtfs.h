@@ -4,12 +4,23 @@
 #include <linux/types.h>
 #include <linux/fs.h>
 #include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/nodemask.h>
 #include <linux/rwsem.h>
+#include <linux/spinlock.h>
 #include <linux/stat.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
 
 #define VTFS_ROOT_INO 100
 #define VTFS_MAX_NAME 256
 
+/* data buffers at least this large are freed from the reclaim workqueue */
+#define VTFS_ASYNC_FREE_MIN (1UL << 20)
+
+/* TTL timer wheel: one slot per second */
+#define VTFS_WHEEL_SLOTS 64
+
 struct inode;
 struct dentry;
 struct file;
@@ -17,10 +28,42 @@ struct super_block;
 struct dir_context;
 struct mnt_idmap;
 struct kstat;
+struct kiocb;
+struct iov_iter;
 struct iattr;
+struct seq_file;
+struct export_operations;
 
 struct vtfs_dir;
 
+/* vtfs_file.flags */
+#define VTFS_F_SNAPSHOT 0x1   /* lives in a read-only snapshot */
+#define VTFS_F_HIDDEN   0x2   /* not listed by readdir (.snapshots) */
+#define VTFS_F_COW      0x4   /* data may be shared with a snapshot */
+
+/* per-inode cache mode state, shared by all names of the inode */
+struct vtfs_cnode {
+    struct list_head lru;        /* CLOCK list, hand at the head */
+    struct list_head wheel;      /* TTL wheel slot, empty without TTL */
+    ino_t            ino;
+    bool             referenced;
+    time64_t         expires;    /* 0: no TTL */
+};
+
+/* totals of everything below a directory, see usage.c */
+struct vtfs_usage {
+    u64 bytes;
+    u64 files;
+    u64 dirs;
+};
+
+/* the same totals as kept in a directory, added to without the write lock */
+struct vtfs_usage_counters {
+    atomic64_t bytes;
+    atomic64_t files;
+    atomic64_t dirs;
+};
+
 struct vtfs_file {
     struct list_head list;
     ino_t            ino;
@@ -28,8 +71,17 @@ struct vtfs_file {
     char             name[VTFS_MAX_NAME];
 
     struct vtfs_dir *dir_data;   
+    struct vtfs_dir *parent;     /* directory holding this name */
+    struct list_head links;      /* other names of the inode, under links_lock */
+    u32              generation;
+    kuid_t           uid;         /* owner, fixed at creation; inodes are filled from it */
+    kgid_t           gid;
+    unsigned int     flags;
     char            *data;       
     size_t           data_size;
+    struct file     *shm;        /* storage=shmem backing, data stays NULL */
+    struct vtfs_cnode *cnode;    /* cache mode only */
+    size_t           charged;    /* bytes in the parents' usage, indexed name only */
 
     unsigned int     nlink;
 };
@@ -37,34 +89,149 @@ struct vtfs_file {
 struct vtfs_dir {
     struct list_head files;      
     struct rw_semaphore sem;
+    ino_t            ino;
+    struct vtfs_dir *parent;     /* NULL for the root */
+    bool             readonly;   /* snapshots and .snapshots itself */
+    struct vtfs_usage_counters usage; /* see vtfs_fs_info.usage_lock */
+};
+
+enum vtfs_storage {
+    VTFS_STORAGE_RAM = 0,
+    VTFS_STORAGE_SHMEM,
+};
+
+enum vtfs_mpol {
+    VTFS_MPOL_DEFAULT = 0,
+    VTFS_MPOL_LOCAL,
+    VTFS_MPOL_BIND,
+    VTFS_MPOL_INTERLEAVE,
 };
 
 struct vtfs_fs_info {
     struct vtfs_dir   root_dir;
-    ino_t             next_ino;
+    /* taken without any directory lock, see vtfs_alloc_ino */
+    atomic64_t        next_ino;
+    atomic_t          next_generation;
     struct super_block *sb;
+
+    /* ino -> one live vtfs_file of that inode, for O(1) inode and handle lookups */
+    struct xarray     inodes;
+
+    /* placement of file data, set by mpol= at mount time */
+    enum vtfs_mpol    mpol;
+    nodemask_t        mpol_nodes;
+    int __percpu     *mpol_rotor;
+    atomic_long_t    *node_bytes;   /* nr_node_ids entries */
+
+    /* data buffer address -> extra owners, see vtfs_data_share() */
+    struct xarray     data_refs;
+    struct mutex      snap_lock;
+
+    /* storage=shmem: ino -> backing file, plus swap-in counters */
+    enum vtfs_storage storage;
+    struct xarray     shm_files;
+    atomic64_t        swapins;
+    atomic64_t        swapin_ns;
+
+    /* cache mode: evict least recently used files past cache_budget, expire TTLs */
+    bool              cache;
+    unsigned long     cache_budget;  /* bytes, 0: unlimited */
+    atomic_long_t     data_bytes;
+    spinlock_t        cache_lock;
+    struct list_head  cache_lru;
+    struct list_head  cache_wheel[VTFS_WHEEL_SLOTS];
+    unsigned long     cache_ttls;
+    time64_t          cache_tick;
+    struct delayed_work cache_work;
+    atomic64_t        cache_hits;
+    atomic64_t        cache_misses;
+    atomic64_t        cache_evictions;
+    atomic64_t        cache_expired;
+
+    /* subtree usage: read for byte charges, write for vtfs_file.charged moves,
+     * parent links and everything else */
+    rwlock_t          usage_lock;
+    /* vtfs_file.links rings and changes of the inodes index; taken before usage_lock */
+    spinlock_t        links_lock;
 };
 
 extern const struct inode_operations vtfs_inode_ops;
 extern const struct file_operations  vtfs_dir_ops;
 extern const struct file_operations  vtfs_file_ops;
+extern const struct super_operations vtfs_super_ops;
+extern const struct export_operations vtfs_export_ops;
 
 
 struct inode *vtfs_get_inode(struct super_block *sb, const struct inode *dir, umode_t mode, ino_t ino);
+struct inode *vtfs_iget(struct super_block *sb, ino_t ino);
 
 struct vtfs_dir  *vtfs_get_dir(struct super_block *sb, struct inode *inode);
+ino_t             vtfs_alloc_ino(struct vtfs_fs_info *info);
+u32               vtfs_alloc_generation(struct vtfs_fs_info *info);
+bool              vtfs_name_ok(const char *name);
 struct vtfs_file *vtfs_find_file(struct vtfs_dir *dir, const char *name);
-struct vtfs_file *vtfs_find_file_by_ino(struct vtfs_dir *dir, ino_t ino);
-struct vtfs_file *vtfs_create_file(struct vtfs_dir *dir, const char *name, umode_t mode, ino_t ino);
+struct vtfs_file *vtfs_create_file(struct vtfs_fs_info *info, struct vtfs_dir *dir,
+                                   const struct inode *dir_inode, const char *name, umode_t mode,
+                                   ino_t ino);
+void vtfs_index_forget(struct vtfs_fs_info *info, struct vtfs_file *file, unsigned int nlink);
+void vtfs_release_contents(struct vtfs_fs_info *info, struct vtfs_file *file);
 
 int  vtfs_remove_file(struct vtfs_dir *dir, const char *name);
+void vtfs_free_entries(struct vtfs_fs_info *info, struct list_head *entries);
 void vtfs_cleanup_dir(struct vtfs_dir *dir);
+void vtfs_free_subtree(struct vtfs_fs_info *info, struct vtfs_dir *dir);
+void vtfs_cleanup_dir_async(struct vtfs_dir *dir);
 
 struct vtfs_file *vtfs_get_file_by_inode(struct inode *inode);
 
-void vtfs_update_nlink_all(struct vtfs_dir *dir, ino_t ino, unsigned int nlink);
-void vtfs_update_data_all(struct vtfs_dir *dir, ino_t ino, char *old_data, char *new_data, size_t new_size);
-void vtfs_remove_all_by_ino(struct vtfs_dir *dir, ino_t ino);
+void vtfs_update_nlink_all(struct vtfs_fs_info *info, ino_t ino, unsigned int nlink);
+void vtfs_update_data_all(struct vtfs_fs_info *info, ino_t ino, char *old_data, char *new_data,
+                          size_t new_size);
+
+int   vtfs_data_node(struct vtfs_fs_info *info);
+char *vtfs_data_realloc(struct vtfs_fs_info *info, char *old, size_t old_size, size_t new_size,
+                        gfp_t gfp);
+void  vtfs_data_free(struct vtfs_fs_info *info, char *data, size_t size);
+void  vtfs_data_forget(struct vtfs_fs_info *info, char *data, size_t size);
+int   vtfs_data_share(struct vtfs_fs_info *info, char *data);
+bool  vtfs_data_release(struct vtfs_fs_info *info, char *data);
+void  vtfs_data_free_async(struct vtfs_fs_info *info, char *data, size_t size);
+
+struct file *vtfs_shm_create(struct vtfs_fs_info *info, ino_t ino);
+void    vtfs_shm_put(struct vtfs_fs_info *info, ino_t ino, struct file *shm);
+void    vtfs_shm_truncate(struct file *shm);
+ssize_t vtfs_shm_read(struct vtfs_fs_info *info, struct file *shm, struct iov_iter *to,
+                      size_t len, loff_t pos, bool nowait);
+ssize_t vtfs_shm_write(struct vtfs_fs_info *info, struct file *shm, struct iov_iter *from,
+                       size_t len, loff_t pos, bool nowait);
+u64     vtfs_shm_swapped_bytes(struct vtfs_fs_info *info);
+
+void vtfs_cache_init(struct vtfs_fs_info *info);
+void vtfs_cache_destroy(struct vtfs_fs_info *info);
+struct vtfs_cnode *vtfs_cache_attach(struct vtfs_fs_info *info, ino_t ino);
+void vtfs_cache_forget(struct vtfs_fs_info *info, struct vtfs_cnode *cnode);
+void vtfs_cache_touch(struct vtfs_file *file);
+int  vtfs_cache_reserve(struct vtfs_fs_info *info, size_t bytes, ino_t self, bool nowait);
+int  vtfs_cache_set_ttl(struct vtfs_fs_info *info, struct inode *inode, u64 seconds);
+extern const struct dentry_operations vtfs_dentry_ops;
+
+void vtfs_usage_link(struct vtfs_fs_info *info, struct vtfs_file *file);
+void vtfs_usage_unlink(struct vtfs_fs_info *info, struct vtfs_file *file, struct vtfs_file *heir);
+void vtfs_usage_move(struct vtfs_fs_info *info, struct vtfs_file *file, struct vtfs_dir *dir);
+void vtfs_usage_charge(struct vtfs_fs_info *info, ino_t ino, size_t size);
+void vtfs_usage_read(struct vtfs_fs_info *info, struct vtfs_dir *dir, struct vtfs_usage *usage);
+
+int vtfs_snapshot_create(struct super_block *sb, const char *name);
+int vtfs_snapshot_delete(struct super_block *sb, const char *name);
+
+long vtfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+long vtfs_batch(struct file *filp, void __user *argp);
+
+int  vtfs_reclaim_init(void);
+void vtfs_reclaim_exit(void);
+
+int vtfs_show_options(struct seq_file *m, struct dentry *root);
+int vtfs_show_stats(struct seq_file *m, struct dentry *root);
 
 
 struct dentry *vtfs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags);
@@ -75,8 +242,10 @@ int vtfs_unlink(struct inode *parent_inode, struct dentry *child_dentry);
 int vtfs_mkdir(struct mnt_idmap *idmap, struct inode *parent_inode, struct dentry *child_dentry, umode_t mode);
 int vtfs_rmdir(struct inode *parent_inode, struct dentry *child_dentry);
 int vtfs_link(struct dentry *old_dentry, struct inode *parent_dir, struct dentry *new_dentry);
-ssize_t vtfs_read(struct file *filp, char __user *buffer, size_t len, loff_t *offset);
-ssize_t vtfs_write(struct file *filp, const char __user *buffer, size_t len, loff_t *offset);
+int vtfs_rename(struct mnt_idmap *idmap, struct inode *old_dir, struct dentry *old_dentry,
+                struct inode *new_dir, struct dentry *new_dentry, unsigned int flags);
+ssize_t vtfs_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t vtfs_write_iter(struct kiocb *iocb, struct iov_iter *from);
 
 int vtfs_open(struct inode *inode, struct file *filp);
 
@@ -0,0 +1,70 @@
+#ifndef _VTFS_IOCTL_H_
+#define _VTFS_IOCTL_H_
+
+/* ioctl interface of vtfs, usable from user space as well */
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define VTFS_IOC_MAGIC 'v'
+
+#define VTFS_SNAPSHOT_DIR      ".snapshots"
+#define VTFS_SNAPSHOT_NAME_MAX 256
+
+struct vtfs_snapshot_args {
+    char name[VTFS_SNAPSHOT_NAME_MAX];
+};
+
+/* cache mode: the file is dropped this many seconds from now, 0 clears */
+struct vtfs_ttl_args {
+    __u64 seconds;
+};
+
+/* vtfs_batch_op.op */
+#define VTFS_BATCH_PUT    1  /* create or replace name with len bytes from data */
+#define VTFS_BATCH_GET    2  /* copy up to len bytes of name into data */
+#define VTFS_BATCH_UNLINK 3
+#define VTFS_BATCH_STAT   4
+
+#define VTFS_BATCH_MAX      1024       /* entries per call */
+#define VTFS_BATCH_DATA_MAX (1 << 20)  /* bytes per put */
+
+struct vtfs_batch_op {
+    __u64 name;    /* in: user pointer to a NUL-terminated name */
+    __u64 data;    /* in: user buffer, put source or get destination */
+    __u64 len;     /* in: put length or get buffer size; out: bytes copied */
+    __u64 size;    /* out: file size */
+    __u64 ino;     /* out */
+    __u32 op;      /* VTFS_BATCH_* */
+    __u32 mode;    /* in: permissions of a file created by put; out: mode */
+    __u32 nlink;   /* out */
+    __s32 result;  /* out: 0 or -errno */
+};
+
+/* one batch runs under a single lock of the directory the ioctl is issued on */
+struct vtfs_batch_args {
+    __u64 ops;     /* user pointer to count entries */
+    __u32 count;
+    __u32 done;    /* out: index of the first failed entry, count if none failed */
+};
+
+struct vtfs_usage_args {
+    __u64 bytes;
+    __u64 files;   /* names of regular files */
+    __u64 dirs;
+};
+
+/* issued on any directory of the mount, needs CAP_SYS_ADMIN */
+#define VTFS_IOC_SNAP_CREATE _IOW(VTFS_IOC_MAGIC, 1, struct vtfs_snapshot_args)
+#define VTFS_IOC_SNAP_DELETE _IOW(VTFS_IOC_MAGIC, 2, struct vtfs_snapshot_args)
+
+/* issued on a regular file opened for writing */
+#define VTFS_IOC_SET_TTL _IOW(VTFS_IOC_MAGIC, 3, struct vtfs_ttl_args)
+
+/* issued on a directory, names are looked up in it */
+#define VTFS_IOC_BATCH _IOWR(VTFS_IOC_MAGIC, 4, struct vtfs_batch_args)
+
+/* issued on a directory: totals of everything below it, hard links count once */
+#define VTFS_IOC_USAGE _IOR(VTFS_IOC_MAGIC, 5, struct vtfs_usage_args)
+
+#endif /* _VTFS_IOCTL_H_ */
@@ -202,6 +202,556 @@ step "Test 9: filesystem still usable"
 echo "final" > "$MOUNT_POINT/final.txt"
 cat "$MOUNT_POINT/final.txt" | grep -q "final" || die "FS unusable after operations"
 
+# ------------------------------
+# Test 10: rename
+# ------------------------------
+step "Test 10: rename"
+
+echo "tmp-data" > "$MOUNT_POINT/tmp.txt"
+mv "$MOUNT_POINT/tmp.txt" "$MOUNT_POINT/final.txt"
+[ ! -e "$MOUNT_POINT/tmp.txt" ] || die "rename source still exists"
+cat "$MOUNT_POINT/final.txt" | grep -q "tmp-data" || die "rename over existing file failed"
+
+mkdir -p "$MOUNT_POINT/src/sub" "$MOUNT_POINT/dst"
+echo "deep" > "$MOUNT_POINT/src/sub/deep.txt"
+mv "$MOUNT_POINT/src/sub" "$MOUNT_POINT/dst/sub"
+cat "$MOUNT_POINT/dst/sub/deep.txt" | grep -q "deep" || die "subtree move failed"
+[ ! -e "$MOUNT_POINT/src/sub" ] || die "moved subtree still in source dir"
+
+rm "$MOUNT_POINT/dst/sub/deep.txt"
+rmdir "$MOUNT_POINT/dst/sub" "$MOUNT_POINT/dst" "$MOUNT_POINT/src"
+
+# ------------------------------
+# Test 11: per-node data stats
+# ------------------------------
+step "Test 11: per-node data stats"
+
+grep -A1 "mounted on $MOUNT_POINT with fstype vtfs" /proc/self/mountstats | grep -q "node_bytes:" \
+  || die "node_bytes missing from mountstats"
+
+# ------------------------------
+# Test 12: readdir reports the real parent
+# ------------------------------
+step "Test 12: readdir reports the real parent"
+
+mkdir -p "$MOUNT_POINT/p/c"
+INO_P=$(ls -id "$MOUNT_POINT/p" | awk '{print $1}')
+INO_DOTDOT=$(ls -ai "$MOUNT_POINT/p/c" | awk '$2 == ".." {print $1}')
+[ "$INO_P" = "$INO_DOTDOT" ] || die "'..' of p/c is $INO_DOTDOT, expected $INO_P"
+rmdir "$MOUNT_POINT/p/c" "$MOUNT_POINT/p"
+
+# ------------------------------
+# Test 13: snapshots
+# ------------------------------
+step "Test 13: snapshots"
+
+# VTFS_IOC_SNAP_CREATE / VTFS_IOC_SNAP_DELETE from include/vtfs_ioctl.h
+snap_ioctl() {
+  python3 - "$MOUNT_POINT" "$1" "$2" <<'PY'
+import fcntl, os, struct, sys
+cmd = {"create": 0x41007601, "delete": 0x41007602}[sys.argv[2]]
+fd = os.open(sys.argv[1], os.O_RDONLY | os.O_DIRECTORY)
+fcntl.ioctl(fd, cmd, struct.pack("256s", sys.argv[3].encode()))
+os.close(fd)
+PY
+}
+
+if command -v python3 >/dev/null 2>&1; then
+  echo "before" > "$MOUNT_POINT/snapfile"
+  snap_ioctl create s1
+  echo "after" > "$MOUNT_POINT/snapfile"
+
+  grep -q "before" "$MOUNT_POINT/.snapshots/s1/snapfile" || die "snapshot lost old data"
+  grep -q "after" "$MOUNT_POINT/snapfile" || die "live file not updated"
+  ! ls -a "$MOUNT_POINT" | grep -q "^.snapshots$" || die ".snapshots is not hidden"
+  ! sh -c "echo x > '$MOUNT_POINT/.snapshots/s1/snapfile'" 2>/dev/null || die "snapshot is writable"
+
+  snap_ioctl delete s1
+  [ ! -e "$MOUNT_POINT/.snapshots/s1" ] || die "snapshot not deleted"
+  rm "$MOUNT_POINT/snapfile"
+else
+  echo "python3 not found, skipping"
+fi
+
+# ------------------------------
+# Test 14: cache mode evicts past the budget
+# ------------------------------
+step "Test 14: cache mode"
+
+CACHE_MNT="$MOUNT_POINT-cache"
+mkdir -p "$CACHE_MNT"
+mount -t vtfs none "$CACHE_MNT" -o cache_size=64k || die "cache mount failed"
+
+for i in 1 2 3 4; do
+  head -c 32768 /dev/zero > "$CACHE_MNT/c$i" || die "cache write $i failed"
+done
+LEFT=$(ls "$CACHE_MNT" | wc -l)
+[ "$LEFT" -le 2 ] || die "nothing evicted: $LEFT files left"
+[ -e "$CACHE_MNT/c4" ] || die "newest file was evicted"
+grep -A2 "mounted on $CACHE_MNT with fstype vtfs" /proc/self/mountstats | grep -q "evictions=[1-9]" \
+  || die "evictions missing from mountstats"
+
+umount "$CACHE_MNT"
+rmdir "$CACHE_MNT"
+
+# ------------------------------
+# Test 15: batched small-file ioctl
+# ------------------------------
+step "Test 15: batch ioctl"
+
+if command -v python3 >/dev/null 2>&1; then
+  mkdir -p "$MOUNT_POINT/batch"
+  # negative dentry that the batch has to invalidate
+  [ ! -e "$MOUNT_POINT/batch/a" ] || die "batch/a exists"
+
+  # VTFS_IOC_BATCH with put a, put b, get a, unlink b, stat b
+  python3 - "$MOUNT_POINT/batch" <<'PY' || die "batch ioctl failed"
+import ctypes, fcntl, os, struct, sys
+
+bufs = []
+def ptr(b):
+    buf = ctypes.create_string_buffer(b, len(b))
+    bufs.append(buf)
+    return ctypes.addressof(buf)
+
+out = ctypes.create_string_buffer(64)
+ops = [(1, b"a", ptr(b"hello"), 5), (1, b"b", ptr(b"world"), 5),
+       (2, b"a", ctypes.addressof(out), 64), (3, b"b", 0, 0), (4, b"b", 0, 0)]
+fmt = "QQQQQIIIi"
+arr = ctypes.create_string_buffer(b"".join(
+    struct.pack(fmt, ptr(name + b"\0"), data, n, 0, 0, op, 0o644, 0, 0) for op, name, data, n in ops))
+args = bytearray(struct.pack("QII", ctypes.addressof(arr), len(ops), 0))
+
+fd = os.open(sys.argv[1], os.O_RDONLY | os.O_DIRECTORY)
+fcntl.ioctl(fd, 0xC0107604, args)
+os.close(fd)
+
+size = struct.calcsize(fmt)
+res = [struct.unpack_from(fmt, arr.raw, i * size)[-1] for i in range(len(ops))]
+got = struct.unpack_from(fmt, arr.raw, 2 * size)[2]
+done = struct.unpack_from("QII", args)[2]
+assert res == [0, 0, 0, 0, -2], res
+assert done == 4, done
+assert out.raw[:got] == b"hello", out.raw[:got]
+PY
+
+  grep -q "hello" "$MOUNT_POINT/batch/a" || die "batch put not visible"
+  [ ! -e "$MOUNT_POINT/batch/b" ] || die "batch unlink not visible"
+  rm -r "$MOUNT_POINT/batch"
+else
+  echo "python3 not found, skipping"
+fi
+
+# ------------------------------
+# Test 16: subtree usage
+# ------------------------------
+step "Test 16: subtree usage"
+
+# VTFS_IOC_USAGE, prints "bytes files dirs"
+usage_ioctl() {
+  python3 - "$1" <<'PY'
+import fcntl, os, struct, sys
+fd = os.open(sys.argv[1], os.O_RDONLY | os.O_DIRECTORY)
+buf = bytearray(24)
+fcntl.ioctl(fd, 0x80187605, buf)
+os.close(fd)
+print(*struct.unpack("QQQ", buf))
+PY
+}
+
+if command -v python3 >/dev/null 2>&1; then
+  mkdir -p "$MOUNT_POINT/u/a"
+  head -c 100 /dev/zero > "$MOUNT_POINT/u/a/f"
+  head -c 50 /dev/zero > "$MOUNT_POINT/u/g"
+  ln "$MOUNT_POINT/u/a/f" "$MOUNT_POINT/u/h"
+
+  [ "$(usage_ioctl "$MOUNT_POINT/u")" = "150 3 1" ] || die "usage of u: $(usage_ioctl "$MOUNT_POINT/u")"
+
+  mv "$MOUNT_POINT/u/a" "$MOUNT_POINT/ua"
+  [ "$(usage_ioctl "$MOUNT_POINT/u")" = "50 2 0" ] || die "usage after rename: $(usage_ioctl "$MOUNT_POINT/u")"
+  [ "$(usage_ioctl "$MOUNT_POINT/ua")" = "100 1 0" ] || die "usage of ua: $(usage_ioctl "$MOUNT_POINT/ua")"
+
+  rm -r "$MOUNT_POINT/u" "$MOUNT_POINT/ua"
+else
+  echo "python3 not found, skipping"
+fi
+
+# ------------------------------
+# Test 17: vectored and non-blocking I/O
+# ------------------------------
+step "Test 17: vectored and non-blocking I/O"
+
+printf "0123456789" > "$MOUNT_POINT/vec"
+
+if command -v python3 >/dev/null 2>&1; then
+  python3 - "$MOUNT_POINT/vec" <<'PY' || die "vectored I/O failed"
+import os, sys
+fd = os.open(sys.argv[1], os.O_RDWR)
+# writing inside the file keeps its size
+assert os.pwrite(fd, b"ab", 2) == 2
+assert os.fstat(fd).st_size == 10
+assert os.pwritev(fd, [b"xy", b"z"], 0) == 3
+a, b = bytearray(4), bytearray(6)
+flags = getattr(os, "RWF_NOWAIT", 0)
+assert os.preadv(fd, [a, b], 0, flags) == 10
+assert bytes(a + b) == b"xyzb456789", bytes(a + b)
+os.close(fd)
+
+# O_APPEND goes through generic_write_checks(), also with RWF_NOWAIT
+os.utime(sys.argv[1], (0, 0))
+fd = os.open(sys.argv[1], os.O_WRONLY | os.O_APPEND)
+try:
+    # the offset is ignored with O_APPEND
+    assert os.pwritev(fd, [b"!"], 0, flags) == 1
+except BlockingIOError:
+    pass
+os.write(fd, b"?")
+os.close(fd)
+with open(sys.argv[1], "rb") as f:
+    data = f.read()
+assert data in (b"xyzb456789!?", b"xyzb456789?"), data
+assert os.stat(sys.argv[1]).st_mtime > 0, "mtime not updated"
+PY
+fi
+rm "$MOUNT_POINT/vec"
+
+# ------------------------------
+# Test 18: renameat2 flags
+# ------------------------------
+step "Test 18: renameat2 flags"
+
+if command -v python3 >/dev/null 2>&1; then
+  mkdir -p "$MOUNT_POINT/r/d1" "$MOUNT_POINT/r/d2/sub"
+  echo "one" > "$MOUNT_POINT/r/d1/f1"
+  echo "two" > "$MOUNT_POINT/r/d2/f2"
+
+  python3 - "$MOUNT_POINT/r" <<'PY' || die "renameat2 failed"
+import ctypes, errno, os, stat, sys
+
+libc = ctypes.CDLL(None, use_errno=True)
+AT_FDCWD = -100
+NOREPLACE, EXCHANGE, WHITEOUT = 1, 2, 4
+r = sys.argv[1]
+
+def rename2(old, new, flags):
+    if libc.renameat2(AT_FDCWD, os.fsencode(old), AT_FDCWD, os.fsencode(new), flags):
+        return ctypes.get_errno()
+    return 0
+
+def read(path):
+    with open(path) as f:
+        return f.read()
+
+# NOREPLACE refuses an existing target and leaves both names alone
+assert rename2(r + "/d1/f1", r + "/d2/f2", NOREPLACE) == errno.EEXIST
+assert read(r + "/d1/f1") == "one\n" and read(r + "/d2/f2") == "two\n"
+
+# EXCHANGE across directories swaps the two names
+ino1 = os.stat(r + "/d1/f1").st_ino
+assert rename2(r + "/d1/f1", r + "/d2/f2", EXCHANGE) == 0
+assert read(r + "/d1/f1") == "two\n" and read(r + "/d2/f2") == "one\n"
+assert os.stat(r + "/d2/f2").st_ino == ino1
+
+# EXCHANGE of a file and a directory, ".." follows the directory
+assert rename2(r + "/d1/f1", r + "/d2/sub", EXCHANGE) == 0
+assert os.path.isdir(r + "/d1/f1") and os.path.isfile(r + "/d2/sub")
+assert os.stat(r + "/d1/f1/..").st_ino == os.stat(r + "/d1").st_ino
+assert read(r + "/d2/sub") == "two\n"
+
+# EXCHANGE needs both names
+assert rename2(r + "/d2/sub", r + "/d2/none", EXCHANGE) == errno.ENOENT
+
+# WHITEOUT leaves a 0:0 character device behind
+assert rename2(r + "/d2/f2", r + "/d1/moved", WHITEOUT) == 0
+st = os.lstat(r + "/d2/f2")
+assert stat.S_ISCHR(st.st_mode) and st.st_rdev == 0, oct(st.st_mode)
+assert read(r + "/d1/moved") == "one\n"
+PY
+
+  rm -r "$MOUNT_POINT/r"
+else
+  echo "python3 not found, skipping"
+fi
+
+# ------------------------------
+# Test 19: unlink of linked names, background reclaim
+# ------------------------------
+step "Test 19: unlink of linked names, background reclaim"
+
+# total data bytes of the mount, from the node_bytes line
+data_bytes() {
+  grep -A1 "mounted on $1 with fstype vtfs" /proc/self/mountstats | grep "node_bytes:" \
+    | grep -o "=[0-9-]*" | tr -d = | awk '{ s += $1 } END { print s + 0 }'
+}
+
+BASE=$(data_bytes "$MOUNT_POINT")
+
+mkdir -p "$MOUNT_POINT/scale"
+for d in $(seq 1 20); do
+  mkdir "$MOUNT_POINT/scale/d$d"
+  (cd "$MOUNT_POINT/scale/d$d" && seq -f "f%g" 1 100 | xargs touch)
+done
+
+head -c 4M /dev/zero > "$MOUNT_POINT/scale/d1/big"
+ln "$MOUNT_POINT/scale/d1/big" "$MOUNT_POINT/scale/d5/big2"
+ln "$MOUNT_POINT/scale/d1/big" "$MOUNT_POINT/scale/d10/big3"
+[ "$(stat -c %h "$MOUNT_POINT/scale/d10/big3")" = "3" ] || die "nlink after ln"
+
+rm "$MOUNT_POINT/scale/d1/big"
+[ "$(stat -c %h "$MOUNT_POINT/scale/d5/big2")" = "2" ] || die "nlink of d5/big2 after rm"
+[ "$(stat -c %h "$MOUNT_POINT/scale/d10/big3")" = "2" ] || die "nlink of d10/big3 after rm"
+[ "$(stat -c %s "$MOUNT_POINT/scale/d10/big3")" = "4194304" ] || die "data lost after rm of one name"
+
+rm "$MOUNT_POINT/scale/d5/big2"
+[ "$(stat -c %h "$MOUNT_POINT/scale/d10/big3")" = "1" ] || die "nlink of the last name"
+echo "tail" >> "$MOUNT_POINT/scale/d10/big3"
+
+# the last name goes, rm returns and the 4 MiB buffer is freed in the background
+rm -r "$MOUNT_POINT/scale"
+for i in $(seq 1 100); do
+  [ "$(data_bytes "$MOUNT_POINT")" -le "$BASE" ] && break
+  sleep 0.1
+done
+[ "$(data_bytes "$MOUNT_POINT")" -le "$BASE" ] || die "memory not reclaimed: $(data_bytes "$MOUNT_POINT") > $BASE"
+
+# ------------------------------
+# Test 20: remount while the old tree is reclaimed
+# ------------------------------
+step "Test 20: remount while the old tree is reclaimed"
+
+RECLAIM_MNT="$MOUNT_POINT-reclaim"
+mkdir -p "$RECLAIM_MNT"
+mount -t vtfs none "$RECLAIM_MNT" || die "reclaim mount failed"
+
+for d in $(seq 1 10); do
+  mkdir "$RECLAIM_MNT/d$d"
+  (cd "$RECLAIM_MNT/d$d" && seq -f "f%g" 1 500 | xargs touch)
+  # big buffers go through the reclaim worker
+  head -c 2M /dev/zero > "$RECLAIM_MNT/d$d/big"
+done
+ln "$RECLAIM_MNT/d1/big" "$RECLAIM_MNT/big-link"
+
+umount "$RECLAIM_MNT" || die "umount of a large tree failed"
+mount -t vtfs none "$RECLAIM_MNT" || die "remount during reclaim failed"
+
+[ -z "$(ls "$RECLAIM_MNT")" ] || die "new mount is not empty"
+echo "fresh" > "$RECLAIM_MNT/f"
+grep -q "fresh" "$RECLAIM_MNT/f" || die "new mount unusable"
+
+umount "$RECLAIM_MNT"
+rmdir "$RECLAIM_MNT"
+
+# ------------------------------
+# Test 21: shmem-backed storage
+# ------------------------------
+step "Test 21: shmem-backed storage"
+
+SHM_MNT="$MOUNT_POINT-shmem"
+mkdir -p "$SHM_MNT"
+mount -t vtfs none "$SHM_MNT" -o storage=shmem || die "shmem mount failed"
+grep -qs " $SHM_MNT vtfs .*storage=shmem" /proc/mounts || die "storage=shmem missing from mount options"
+
+echo "hello" > "$SHM_MNT/s"
+echo "world" >> "$SHM_MNT/s"
+[ "$(cat "$SHM_MNT/s")" = "$(printf 'hello\nworld')" ] || die "shmem read/write failed"
+
+# spans several pages
+head -c 20000 /dev/urandom > /tmp/vtfs-shm.bin
+cp /tmp/vtfs-shm.bin "$SHM_MNT/big"
+cmp -s /tmp/vtfs-shm.bin "$SHM_MNT/big" || die "shmem multi-page data differs"
+rm -f /tmp/vtfs-shm.bin
+
+echo "new" > "$SHM_MNT/big"
+[ "$(cat "$SHM_MNT/big")" = "new" ] || die "shmem truncate left old data"
+[ "$(stat -c %s "$SHM_MNT/big")" = "4" ] || die "shmem truncate size wrong"
+
+grep -A3 "mounted on $SHM_MNT with fstype vtfs" /proc/self/mountstats | grep -q "swap: swapped_bytes=" \
+  || die "swap line missing from mountstats"
+
+rm "$SHM_MNT/s" "$SHM_MNT/big"
+umount "$SHM_MNT"
+rmdir "$SHM_MNT"
+
+# ------------------------------
+# Test 22: file handles
+# ------------------------------
+step "Test 22: file handles"
+
+if command -v python3 >/dev/null 2>&1; then
+  echo "by-handle" > "$MOUNT_POINT/fh"
+  mkdir -p "$MOUNT_POINT/fhdir"
+
+  python3 - "$MOUNT_POINT" <<'PY' || die "file handles failed"
+import ctypes, errno, os, struct, sys
+
+libc = ctypes.CDLL(None, use_errno=True)
+AT_FDCWD = -100
+MAX_HANDLE_SZ = 128
+mnt = sys.argv[1]
+
+# struct file_handle { u32 handle_bytes; s32 handle_type; u8 f_handle[]; }
+def handle(path):
+    buf = ctypes.create_string_buffer(struct.pack("Ii", MAX_HANDLE_SZ, 0), 8 + MAX_HANDLE_SZ)
+    mount_id = ctypes.c_int()
+    if libc.name_to_handle_at(AT_FDCWD, os.fsencode(path), buf, ctypes.byref(mount_id), 0):
+        raise OSError(ctypes.get_errno(), "name_to_handle_at " + path)
+    return buf
+
+def open_handle(mount_fd, buf):
+    fd = libc.open_by_handle_at(mount_fd, buf, os.O_RDONLY)
+    if fd < 0:
+        return -ctypes.get_errno()
+    return fd
+
+mount_fd = os.open(mnt, os.O_RDONLY | os.O_DIRECTORY)
+
+fh = handle(mnt + "/fh")
+fd = open_handle(mount_fd, fh)
+assert fd >= 0, fd
+assert os.read(fd, 64) == b"by-handle\n"
+assert os.fstat(fd).st_ino == os.stat(mnt + "/fh").st_ino
+os.close(fd)
+
+dh = handle(mnt + "/fhdir")
+fd = open_handle(mount_fd, dh)
+assert fd >= 0, fd
+assert os.fstat(fd).st_ino == os.stat(mnt + "/fhdir").st_ino
+os.close(fd)
+
+# handles of removed files go stale
+os.unlink(mnt + "/fh")
+os.rmdir(mnt + "/fhdir")
+assert open_handle(mount_fd, fh) == -errno.ESTALE
+assert open_handle(mount_fd, dh) == -errno.ESTALE
+
+# ownership does not depend on whether a lookup or a handle loads the inode
+os.mkdir(mnt + "/owned")
+os.chown(mnt + "/owned", 65534, 65534)
+with open(mnt + "/owned/f", "w") as f:
+    f.write("x")
+oh = handle(mnt + "/owned/f")
+with open("/proc/sys/vm/drop_caches", "w") as f:
+    f.write("2")
+fd = open_handle(mount_fd, oh)
+assert fd >= 0, fd
+st = os.fstat(fd)
+assert (st.st_uid, st.st_gid) == (65534, 65534), (st.st_uid, st.st_gid)
+os.close(fd)
+os.unlink(mnt + "/owned/f")
+os.rmdir(mnt + "/owned")
+os.close(mount_fd)
+PY
+else
+  echo "python3 not found, skipping"
+fi
+
+# ------------------------------
+# Test 23: hard links of snapshotted files
+# ------------------------------
+step "Test 23: hard links of snapshotted files"
+
+if command -v python3 >/dev/null 2>&1; then
+  SNAP_MNT="$MOUNT_POINT-snap"
+  mkdir -p "$SNAP_MNT"
+  mount -t vtfs none "$SNAP_MNT" || die "snapshot mount failed"
+
+  echo "shared" > "$SNAP_MNT/a"
+  MOUNT_POINT="$SNAP_MNT" snap_ioctl create s1
+  ln "$SNAP_MNT/a" "$SNAP_MNT/b"
+  rm "$SNAP_MNT/a"
+  echo "changed" > "$SNAP_MNT/b"
+  grep -q "shared" "$SNAP_MNT/.snapshots/s1/a" || die "snapshot lost data after ln/rm"
+
+  python3 - "$SNAP_MNT/.snapshots/s1/a" <<'PY' || die "O_TRUNC on a snapshot file was allowed"
+import errno, os, sys
+try:
+    os.open(sys.argv[1], os.O_RDONLY | os.O_TRUNC)
+except OSError as e:
+    assert e.errno == errno.EROFS, e
+else:
+    raise AssertionError("opened")
+PY
+  grep -q "shared" "$SNAP_MNT/.snapshots/s1/a" || die "snapshot truncated"
+
+  # teardown frees the buffer shared by b and the snapshot once
+  umount "$SNAP_MNT" || die "umount after snapshot, ln, rm failed"
+  rmdir "$SNAP_MNT"
+else
+  echo "python3 not found, skipping"
+fi
+
+# ------------------------------
+# Test 24: cache TTL expiry
+# ------------------------------
+step "Test 24: cache TTL expiry"
+
+if command -v python3 >/dev/null 2>&1; then
+  CACHE_MNT="$MOUNT_POINT-cache"
+  mkdir -p "$CACHE_MNT"
+  mount -t vtfs none "$CACHE_MNT" -o cache || die "cache mount failed"
+
+  echo "short" > "$CACHE_MNT/short"
+  echo "long" > "$CACHE_MNT/long"
+  cat "$CACHE_MNT/short" >/dev/null
+
+  # VTFS_IOC_SET_TTL, 1 second
+  python3 - "$CACHE_MNT/short" <<'PY' || die "set ttl failed"
+import fcntl, os, struct, sys
+fd = os.open(sys.argv[1], os.O_WRONLY)
+fcntl.ioctl(fd, 0x40087603, struct.pack("Q", 1))
+os.close(fd)
+PY
+
+  sleep 3
+  [ ! -e "$CACHE_MNT/short" ] || die "file did not expire"
+  STATS=$(grep -A2 "mounted on $CACHE_MNT with fstype vtfs" /proc/self/mountstats)
+  echo "$STATS" | grep -q "expired=1" || die "expired missing from mountstats"
+  # cat and the ioctl open are hits, the creating opens are not
+  echo "$STATS" | grep -q "hits=2 " || die "wrong hit count: $STATS"
+  grep -q "long" "$CACHE_MNT/long" || die "file without a TTL expired"
+
+  umount "$CACHE_MNT"
+  rmdir "$CACHE_MNT"
+else
+  echo "python3 not found, skipping"
+fi
+
+# ------------------------------
+# Test 25: batch unlink honours the sticky bit
+# ------------------------------
+step "Test 25: batch unlink honours the sticky bit"
+
+if command -v python3 >/dev/null 2>&1; then
+  mkdir -p "$MOUNT_POINT/sticky"
+  chmod 1777 "$MOUNT_POINT/sticky"
+  echo "root" > "$MOUNT_POINT/sticky/owned"
+
+  # VTFS_IOC_BATCH with one unlink, run as nobody
+  python3 - "$MOUNT_POINT/sticky" <<'PY' || die "batch unlink ignored the sticky bit"
+import ctypes, errno, fcntl, os, struct, sys
+
+pid = os.fork()
+if pid == 0:
+    os.setgid(65534)
+    os.setuid(65534)
+    name = ctypes.create_string_buffer(b"owned\0")
+    fmt = "QQQQQIIIi"
+    arr = ctypes.create_string_buffer(struct.pack(fmt, ctypes.addressof(name), 0, 0, 0, 0, 3, 0, 0, 0))
+    args = bytearray(struct.pack("QII", ctypes.addressof(arr), 1, 0))
+    fd = os.open(sys.argv[1], os.O_RDONLY | os.O_DIRECTORY)
+    fcntl.ioctl(fd, 0xC0107604, args)
+    res = struct.unpack_from(fmt, arr.raw)[-1]
+    os._exit(0 if res == -errno.EPERM else 1)
+_, status = os.waitpid(pid, 0)
+sys.exit(os.waitstatus_to_exitcode(status))
+PY
+
+  [ -e "$MOUNT_POINT/sticky/owned" ] || die "file removed from a sticky directory"
+  rm -r "$MOUNT_POINT/sticky"
+else
+  echo "python3 not found, skipping"
+fi
+
 # ============================================================
 # TESTS END
 # ============================================================
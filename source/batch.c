@@ -0,0 +1,552 @@
+#include <linux/capability.h>
+#include <linux/cred.h>
+#include <linux/dcache.h>
+#include <linux/mnt_idmapping.h>
+#include <linux/mount.h>
+#include <linux/uio.h>
+#include <linux/namei.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/uaccess.h>
+
+#include "vtfs.h"
+#include "vtfs_ioctl.h"
+
+// VTFS_IOC_BATCH: many small puts/gets/unlinks/stats in one call. Names and put
+// data are copied in and buffers allocated before anything is locked. Then the
+// targets of all entries are looked up and their inodes locked, in address
+// order like lock_two_nondirectories(), and dir->sem is taken once for the
+// whole batch. Freeing and dcache updates are done after dir->sem is dropped
+// and before the inodes are unlocked, the same way vtfs_unlink does it.
+
+struct vtfs_batch_ent {
+  char name[VTFS_MAX_NAME];
+  char* data;                // put: prepared buffer until it is attached
+  ino_t ino;                 // target found by vtfs_batch_resolve()
+  struct inode* inode;       // its inode, locked for the whole batch
+  struct inode* target;      // inode the entry ran on, NULL if born in this batch
+  struct vtfs_file* removed; // unlink: entry already off the list
+  unsigned int nlink;        // unlink: links left
+  bool replaced;             // put over an existing file
+  char* old_data;
+  size_t old_size;
+  bool dentry_stale;
+};
+
+static bool vtfs_batch_mutates(const struct vtfs_batch_op* op) {
+  return op->op == VTFS_BATCH_PUT || op->op == VTFS_BATCH_UNLINK;
+}
+
+static int vtfs_batch_prepare(
+    struct vtfs_fs_info* info, struct vtfs_batch_op* op, struct vtfs_batch_ent* ent
+) {
+  long len;
+
+  len = strncpy_from_user(ent->name, u64_to_user_ptr(op->name), VTFS_MAX_NAME);
+  if (len < 0)
+    return len;
+  if (len == VTFS_MAX_NAME)
+    return -ENAMETOOLONG;
+  if (!vtfs_name_ok(ent->name))
+    return -EINVAL;
+
+  switch (op->op) {
+    case VTFS_BATCH_PUT:
+      // small objects only; shmem files are written through the page cache
+      if (info->storage != VTFS_STORAGE_RAM)
+        return -EOPNOTSUPP;
+      if (op->len > VTFS_BATCH_DATA_MAX)
+        return -EFBIG;
+      if (!op->len)
+        return 0;
+
+      ent->data = vtfs_data_realloc(info, NULL, 0, op->len, GFP_KERNEL);
+      if (!ent->data)
+        return -ENOMEM;
+      if (copy_from_user(ent->data, u64_to_user_ptr(op->data), op->len))
+        return -EFAULT;
+      return 0;
+    case VTFS_BATCH_GET:
+    case VTFS_BATCH_UNLINK:
+    case VTFS_BATCH_STAT:
+      return 0;
+    default:
+      return -EINVAL;
+  }
+}
+
+// Looks every target up under one read of dir->sem, then instantiates the
+// inodes with it dropped. Names of nothing or of a directory get no inode.
+static void vtfs_batch_resolve(
+    struct file* filp,
+    struct vtfs_dir* dir,
+    struct vtfs_batch_op* ops,
+    struct vtfs_batch_ent* ents,
+    u32 count
+) {
+  struct super_block* sb = file_inode(filp)->i_sb;
+  u32 i;
+
+  down_read(&dir->sem);
+  for (i = 0; i < count; i++) {
+    struct vtfs_file* file;
+
+    ents[i].ino = 0;
+    if (ops[i].result || ops[i].op == VTFS_BATCH_STAT)
+      continue;
+
+    file = vtfs_find_file(dir, ents[i].name);
+    if (file && !S_ISDIR(file->mode))
+      ents[i].ino = file->ino;
+  }
+  up_read(&dir->sem);
+
+  for (i = 0; i < count; i++) {
+    struct inode* inode;
+
+    if (!ents[i].ino)
+      continue;
+
+    inode = vtfs_iget(sb, ents[i].ino);
+    if (IS_ERR(inode)) {
+      // gone meanwhile: vtfs_batch_verify() sees whether the name went too
+      if (PTR_ERR(inode) != -ESTALE)
+        ops[i].result = PTR_ERR(inode);
+      continue;
+    }
+    ents[i].inode = inode;
+  }
+}
+
+// the name still leads to the locked inode (or, like before, to none)
+static bool vtfs_batch_locked(struct vtfs_file* file, struct vtfs_batch_ent* ent) {
+  ino_t ino = file && !S_ISDIR(file->mode) ? file->ino : 0;
+
+  return ino == (ent->inode ? ent->inode->i_ino : 0);
+}
+
+// under dir->sem, before any entry runs
+static bool vtfs_batch_verify(
+    struct vtfs_dir* dir, struct vtfs_batch_op* ops, struct vtfs_batch_ent* ents, u32 count
+) {
+  u32 i;
+
+  for (i = 0; i < count; i++) {
+    if (ops[i].result || ops[i].op == VTFS_BATCH_STAT)
+      continue;
+    if (!vtfs_batch_locked(vtfs_find_file(dir, ents[i].name), &ents[i]))
+      return false;
+  }
+  return true;
+}
+
+static int vtfs_batch_inode_cmp(const void* a, const void* b) {
+  const struct inode* x = *(const struct inode* const*)a;
+  const struct inode* y = *(const struct inode* const*)b;
+
+  return x < y ? -1 : x > y;
+}
+
+// Several entries may share an inode (same name twice, hard links), each is
+// locked once. The locks nest under the directory's VFS lock for lockdep.
+static u32 vtfs_batch_lock_inodes(
+    struct inode* dir_inode, struct vtfs_batch_ent* ents, u32 count, struct inode** locked
+) {
+  u32 i, n = 0, nlocked = 0;
+
+  for (i = 0; i < count; i++) {
+    if (ents[i].inode)
+      locked[n++] = ents[i].inode;
+  }
+  sort(locked, n, sizeof(*locked), vtfs_batch_inode_cmp, NULL);
+
+  for (i = 0; i < n; i++) {
+    if (nlocked && locked[nlocked - 1] == locked[i])
+      continue;
+    down_write_nest_lock(&locked[i]->i_rwsem, &dir_inode->i_rwsem);
+    locked[nlocked++] = locked[i];
+  }
+  return nlocked;
+}
+
+static void vtfs_batch_unlock_inodes(struct inode** locked, u32 nlocked) {
+  while (nlocked)
+    inode_unlock(locked[--nlocked]);
+}
+
+static void vtfs_batch_put_inodes(struct vtfs_batch_ent* ents, u32 count) {
+  u32 i;
+
+  for (i = 0; i < count; i++) {
+    if (ents[i].inode) {
+      iput(ents[i].inode);
+      ents[i].inode = NULL;
+    }
+  }
+}
+
+static int vtfs_batch_permission(struct file* filp, struct vtfs_batch_ent* ent, int mask) {
+  // born in this batch from the caller's own data
+  if (!ent->target)
+    return 0;
+  return inode_permission(file_mnt_idmap(filp), ent->target, mask);
+}
+
+// sticky directories: only the owner of the file or of the directory, or
+// CAP_FOWNER, may remove a name, like may_delete()
+static bool vtfs_batch_sticky_ok(struct file* filp, struct inode* inode) {
+  struct mnt_idmap* idmap = file_mnt_idmap(filp);
+  struct inode* dir = file_inode(filp);
+  kuid_t fsuid = current_fsuid();
+
+  if (!(dir->i_mode & S_ISVTX))
+    return true;
+  if (vfsuid_eq_kuid(i_uid_into_vfsuid(idmap, inode), fsuid) ||
+      vfsuid_eq_kuid(i_uid_into_vfsuid(idmap, dir), fsuid))
+    return true;
+  return capable_wrt_inode_uidgid(idmap, inode, CAP_FOWNER);
+}
+
+static void vtfs_batch_fill(struct vtfs_batch_op* op, struct vtfs_file* file) {
+  op->ino = file->ino;
+  op->mode = file->mode;
+  op->size = file->data_size;
+  op->nlink = S_ISDIR(file->mode) ? 2 : file->nlink;
+}
+
+static int vtfs_batch_get(
+    struct file* filp, struct vtfs_file* file, struct vtfs_batch_op* op, struct vtfs_batch_ent* ent
+) {
+  struct vtfs_fs_info* info = file_inode(filp)->i_sb->s_fs_info;
+  struct iov_iter iter;
+  size_t n;
+  int err;
+
+  if (!file)
+    return -ENOENT;
+  if (S_ISDIR(file->mode))
+    return -EISDIR;
+  if (!S_ISREG(file->mode))
+    return -EINVAL;
+
+  err = vtfs_batch_permission(filp, ent, MAY_READ);
+  if (err)
+    return err;
+
+  vtfs_batch_fill(op, file);
+  n = min_t(u64, op->len, file->data_size);
+  op->len = 0;
+
+  err = import_ubuf(ITER_DEST, u64_to_user_ptr(op->data), n, &iter);
+  if (err)
+    return err;
+
+  if (n && file->shm) {
+    ssize_t ret = vtfs_shm_read(info, file->shm, &iter, n, 0, false);
+
+    if (ret < 0)
+      return ret;
+    n = ret;
+  } else if (n && copy_to_iter(file->data, n, &iter) != n) {
+    return -EFAULT;
+  }
+
+  op->len = n;
+  vtfs_cache_touch(file);
+  if (info->cache)
+    atomic64_inc(&info->cache_hits);
+  return 0;
+}
+
+static int vtfs_batch_put(
+    struct file* filp,
+    struct vtfs_dir* dir,
+    struct vtfs_file* file,
+    struct vtfs_batch_op* op,
+    struct vtfs_batch_ent* ent
+) {
+  struct vtfs_fs_info* info = file_inode(filp)->i_sb->s_fs_info;
+  struct vtfs_cnode* cnode;
+  int err;
+
+  if (file) {
+    if (S_ISDIR(file->mode))
+      return -EISDIR;
+    if (!S_ISREG(file->mode))
+      return -EINVAL;
+
+    err = vtfs_batch_permission(filp, ent, MAY_WRITE);
+    if (err)
+      return err;
+
+    // replace, like open(O_TRUNC) + write; the old buffer goes once dir->sem is dropped
+    ent->replaced = true;
+    ent->old_data = file->data;
+    ent->old_size = file->data_size;
+  } else {
+    ino_t ino = vtfs_alloc_ino(info);
+
+    file = vtfs_create_file(info, dir, file_inode(filp), ent->name, S_IFREG | (op->mode & 0777 & ~current_umask()), ino);
+    if (!file)
+      return -ENOMEM;
+
+    cnode = vtfs_cache_attach(info, ino);
+    if (IS_ERR(cnode)) {
+      list_del(&file->list);
+      vtfs_index_forget(info, file, 0);
+      kfree(file);
+      return PTR_ERR(cnode);
+    }
+    file->cnode = cnode;
+    vtfs_usage_link(info, file);
+    ent->dentry_stale = true;
+  }
+
+  // later entries may reach the inode through another name
+  if (file->nlink > 1) {
+    vtfs_update_data_all(info, file->ino, file->data, ent->data, op->len);
+  } else {
+    file->data = ent->data;
+    file->data_size = op->len;
+  }
+  ent->data = NULL;
+  vtfs_usage_charge(info, file->ino, file->data_size);
+  vtfs_cache_touch(file);
+
+  if (ent->target)
+    i_size_write(ent->target, file->data_size);
+
+  vtfs_batch_fill(op, file);
+  op->len = file->data_size;
+  return 0;
+}
+
+static int vtfs_batch_unlink(
+    struct file* filp, struct vtfs_file* file, struct vtfs_batch_op* op, struct vtfs_batch_ent* ent
+) {
+  struct vtfs_fs_info* info = file_inode(filp)->i_sb->s_fs_info;
+
+  if (!file)
+    return -ENOENT;
+  if (S_ISDIR(file->mode))
+    return -EISDIR;
+  if (ent->target && !vtfs_batch_sticky_ok(filp, ent->target))
+    return -EPERM;
+
+  vtfs_batch_fill(op, file);
+  list_del(&file->list);
+  ent->removed = file;
+  ent->nlink = file->nlink ? file->nlink - 1 : 0;
+  ent->dentry_stale = true;
+
+  // later entries may unlink another name of the same inode
+  vtfs_index_forget(info, file, ent->nlink);
+  if (ent->nlink)
+    vtfs_update_nlink_all(info, file->ino, ent->nlink);
+  return 0;
+}
+
+static int vtfs_batch_stat(struct vtfs_file* file, struct vtfs_batch_op* op) {
+  if (!file)
+    return -ENOENT;
+
+  vtfs_batch_fill(op, file);
+  return 0;
+}
+
+// Freeing and dcache updates, in entry order; dir->sem is no longer held, the
+// target inodes still are, so readers never see the old buffer being freed.
+static void vtfs_batch_finish(struct file* filp, struct vtfs_batch_ent* ent) {
+  struct dentry* parent = filp->f_path.dentry;
+  struct vtfs_fs_info* info = parent->d_sb->s_fs_info;
+  struct vtfs_file* file = ent->removed;
+
+  if (ent->replaced)
+    vtfs_data_free_async(info, ent->old_data, ent->old_size);
+
+  if (file) {
+    if (!ent->nlink)
+      vtfs_release_contents(info, file);
+
+    // open descriptors keep the inode, it only loses the link
+    if (ent->target)
+      set_nlink(ent->target, ent->nlink);
+    kfree(file);
+  }
+
+  if (ent->dentry_stale) {
+    struct qstr name = QSTR_INIT(ent->name, strlen(ent->name));
+    struct dentry* child = d_hash_and_lookup(parent, &name);
+
+    if (!IS_ERR_OR_NULL(child)) {
+      d_invalidate(child);
+      dput(child);
+    }
+  }
+}
+
+static void vtfs_batch_lock_dir(struct vtfs_dir* dir, bool shared) {
+  if (shared)
+    down_read(&dir->sem);
+  else
+    down_write(&dir->sem);
+}
+
+static void vtfs_batch_unlock_dir(struct vtfs_dir* dir, bool shared) {
+  if (shared)
+    up_read(&dir->sem);
+  else
+    up_write(&dir->sem);
+}
+
+// under dir->sem; earlier entries of the batch have run already
+static int vtfs_batch_one(
+    struct file* filp, struct vtfs_dir* dir, struct vtfs_batch_op* op, struct vtfs_batch_ent* ent
+) {
+  struct vtfs_file* file = vtfs_find_file(dir, ent->name);
+
+  // A name that no longer leads to its locked inode was created by an
+  // earlier entry: no inode exists for it yet, and the directory's VFS lock
+  // keeps lookups from making one.
+  ent->target = vtfs_batch_locked(file, ent) ? ent->inode : NULL;
+
+  switch (op->op) {
+    case VTFS_BATCH_PUT:
+      return vtfs_batch_put(filp, dir, file, op, ent);
+    case VTFS_BATCH_GET:
+      return vtfs_batch_get(filp, file, op, ent);
+    case VTFS_BATCH_UNLINK:
+      return vtfs_batch_unlink(filp, file, op, ent);
+    default:
+      return vtfs_batch_stat(file, op);
+  }
+}
+
+long vtfs_batch(struct file* filp, void __user* argp) {
+  struct inode* dir_inode = file_inode(filp);
+  struct vtfs_fs_info* info = dir_inode->i_sb->s_fs_info;
+  struct vtfs_dir* dir = vtfs_get_dir(dir_inode->i_sb, dir_inode);
+  struct vtfs_batch_args args;
+  struct vtfs_batch_op* ops;
+  struct vtfs_batch_ent* ents;
+  struct inode** locked;
+  u32 nlocked;
+  bool mutates = false;
+  size_t put_bytes = 0;
+  long err = 0;
+  u32 i;
+
+  if (!info || !dir)
+    return -ENOENT;
+
+  if (copy_from_user(&args, argp, sizeof(args)))
+    return -EFAULT;
+
+  if (!args.count)
+    return 0;
+  if (args.count > VTFS_BATCH_MAX)
+    return -E2BIG;
+
+  ops = memdup_user(u64_to_user_ptr(args.ops), array_size(args.count, sizeof(*ops)));
+  if (IS_ERR(ops))
+    return PTR_ERR(ops);
+
+  ents = kvcalloc(args.count, sizeof(*ents), GFP_KERNEL);
+  locked = kvmalloc_array(args.count, sizeof(*locked), GFP_KERNEL);
+  if (!ents || !locked) {
+    err = -ENOMEM;
+    goto out_free;
+  }
+
+  for (i = 0; i < args.count; i++) {
+    mutates |= vtfs_batch_mutates(&ops[i]);
+    if (ops[i].op == VTFS_BATCH_PUT && ops[i].len <= VTFS_BATCH_DATA_MAX)
+      put_bytes += ops[i].len;
+  }
+
+  err = inode_permission(file_mnt_idmap(filp), dir_inode, mutates ? MAY_WRITE | MAY_EXEC : MAY_EXEC);
+  if (err)
+    goto out_free;
+
+  if (mutates) {
+    err = mnt_want_write_file(filp);
+    if (err)
+      goto out_free;
+
+    // other files are evicted before we lock, eviction takes directory locks itself
+    err = vtfs_cache_reserve(info, put_bytes, 0, false);
+    if (err)
+      goto out_drop_write;
+  }
+
+  for (i = 0; i < args.count; i++) {
+    ops[i].result = vtfs_batch_prepare(info, &ops[i], &ents[i]);
+    if (!ops[i].result && dir->readonly && vtfs_batch_mutates(&ops[i]))
+      ops[i].result = -EROFS;
+  }
+
+  // The VFS lock keeps lookups from caching names while we change them, and
+  // the target inode locks nest under it.
+  if (mutates)
+    inode_lock(dir_inode);
+  else
+    inode_lock_shared(dir_inode);
+
+  for (;;) {
+    vtfs_batch_resolve(filp, dir, ops, ents, args.count);
+    nlocked = vtfs_batch_lock_inodes(dir_inode, ents, args.count, locked);
+    vtfs_batch_lock_dir(dir, !mutates);
+    if (vtfs_batch_verify(dir, ops, ents, args.count))
+      break;
+
+    // a name was replaced before we got the inode locks
+    vtfs_batch_unlock_dir(dir, !mutates);
+    vtfs_batch_unlock_inodes(locked, nlocked);
+    vtfs_batch_put_inodes(ents, args.count);
+  }
+
+  for (i = 0; i < args.count; i++) {
+    struct vtfs_batch_op* op = &ops[i];
+
+    if (op->result)
+      continue;
+
+    op->result = vtfs_batch_one(filp, dir, op, &ents[i]);
+    if (op->result == -ENOENT && info->cache)
+      atomic64_inc(&info->cache_misses);
+  }
+
+  vtfs_batch_unlock_dir(dir, !mutates);
+  for (i = 0; i < args.count; i++) {
+    vtfs_batch_finish(filp, &ents[i]);
+  }
+  vtfs_batch_unlock_inodes(locked, nlocked);
+
+  if (mutates)
+    inode_unlock(dir_inode);
+  else
+    inode_unlock_shared(dir_inode);
+
+  for (args.done = 0; args.done < args.count; args.done++) {
+    if (ops[args.done].result)
+      break;
+  }
+  if (copy_to_user(u64_to_user_ptr(args.ops), ops, array_size(args.count, sizeof(*ops))) ||
+      copy_to_user(argp, &args, sizeof(args)))
+    err = -EFAULT;
+
+  for (i = 0; i < args.count; i++) {
+    if (ents[i].data)
+      vtfs_data_free(info, ents[i].data, ops[i].len);
+  }
+  vtfs_batch_put_inodes(ents, args.count);
+
+out_drop_write:
+  if (mutates)
+    mnt_drop_write_file(filp);
+out_free:
+  kvfree(locked);
+  kvfree(ents);
+  kfree(ops);
+  return err;
+}
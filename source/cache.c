@@ -0,0 +1,281 @@
+#include <linux/dcache.h>
+#include <linux/namei.h>
+#include <linux/slab.h>
+#include <linux/timekeeping.h>
+
+#include "vtfs.h"
+
+// Cache mode (-o cache[,cache_size=N]): regular files are evicted with a CLOCK
+// approximation of LRU once the data budget is exceeded, and files with a TTL
+// are expired by a timer wheel worker. Readers only set cnode->referenced, the
+// cache lock is taken by create/remove and by the evictor.
+
+static void vtfs_cache_wheel_work(struct work_struct* work);
+
+void vtfs_cache_init(struct vtfs_fs_info* info) {
+  int i;
+
+  spin_lock_init(&info->cache_lock);
+  INIT_LIST_HEAD(&info->cache_lru);
+  for (i = 0; i < VTFS_WHEEL_SLOTS; i++)
+    INIT_LIST_HEAD(&info->cache_wheel[i]);
+  info->cache_tick = ktime_get_seconds();
+  INIT_DELAYED_WORK(&info->cache_work, vtfs_cache_wheel_work);
+}
+
+struct vtfs_cnode* vtfs_cache_attach(struct vtfs_fs_info* info, ino_t ino) {
+  struct vtfs_cnode* cnode;
+
+  if (!info->cache)
+    return NULL;
+
+  cnode = kzalloc(sizeof(*cnode), GFP_KERNEL);
+  if (!cnode)
+    return ERR_PTR(-ENOMEM);
+
+  INIT_LIST_HEAD(&cnode->wheel);
+  cnode->ino = ino;
+
+  spin_lock(&info->cache_lock);
+  list_add_tail(&cnode->lru, &info->cache_lru);
+  spin_unlock(&info->cache_lock);
+  return cnode;
+}
+
+static void vtfs_cache_unwheel(struct vtfs_fs_info* info, struct vtfs_cnode* cnode) {
+  if (list_empty(&cnode->wheel))
+    return;
+
+  list_del_init(&cnode->wheel);
+  info->cache_ttls--;
+}
+
+// info == NULL on umount teardown, the lists die with the mount
+void vtfs_cache_forget(struct vtfs_fs_info* info, struct vtfs_cnode* cnode) {
+  if (!cnode)
+    return;
+
+  if (info) {
+    spin_lock(&info->cache_lock);
+    list_del(&cnode->lru);
+    vtfs_cache_unwheel(info, cnode);
+    spin_unlock(&info->cache_lock);
+  }
+  kfree(cnode);
+}
+
+void vtfs_cache_touch(struct vtfs_file* file) {
+  struct vtfs_cnode* cnode = file ? file->cnode : NULL;
+
+  // plain store, and only when the bit flips, to keep the cacheline clean
+  if (cnode && !READ_ONCE(cnode->referenced))
+    WRITE_ONCE(cnode->referenced, true);
+}
+
+// Removes every name of the inode. The cnode is freed with the last name,
+// together with the data. The victim's inode lock keeps readers and writers
+// off the buffer, so the inode is instantiated if it is not cached, and a
+// victim somebody is using is skipped (false). Callers may hold the lock of
+// another inode, hence the trylock.
+static bool vtfs_cache_evict(struct vtfs_fs_info* info, ino_t ino) {
+  struct vtfs_file* file;
+  struct inode* inode;
+
+  inode = vtfs_iget(info->sb, ino);
+  if (IS_ERR(inode))
+    return PTR_ERR(inode) == -ESTALE;  // already gone
+  if (!inode_trylock(inode)) {
+    iput(inode);
+    return false;
+  }
+
+  while ((file = xa_load(&info->inodes, ino)) != NULL) {
+    struct vtfs_dir* dir = READ_ONCE(file->parent);
+    unsigned int nlink;
+
+    down_write(&dir->sem);
+    // a concurrent unlink or rename got there first, look again
+    if (xa_load(&info->inodes, ino) != file || file->parent != dir) {
+      up_write(&dir->sem);
+      continue;
+    }
+    list_del(&file->list);
+    nlink = file->nlink ? file->nlink - 1 : 0;
+    up_write(&dir->sem);
+
+    vtfs_index_forget(info, file, nlink);
+    if (nlink)
+      vtfs_update_nlink_all(info, ino, nlink);
+    else
+      vtfs_release_contents(info, file);
+    kfree(file);
+  }
+
+  // descriptors that are still open read an empty file and fail writes with
+  // -ENOENT, dentries fail revalidation
+  clear_nlink(inode);
+  inode_unlock(inode);
+  iput(inode);
+  return true;
+}
+
+// Next CLOCK victim. It goes to the tail rather than off the list: an evicted
+// cnode leaves with its last name, a busy one is simply met again later.
+static bool vtfs_cache_pick(struct vtfs_fs_info* info, ino_t self, ino_t* victim) {
+  struct vtfs_cnode *cnode, *tmp;
+  LIST_HEAD(skipped);
+  bool found = false;
+  int pass;
+
+  spin_lock(&info->cache_lock);
+  // two passes: the first one may only clear referenced bits
+  for (pass = 0; pass < 2 && !found; pass++) {
+    list_for_each_entry_safe(cnode, tmp, &info->cache_lru, lru) {
+      if (cnode->ino == self) {
+        list_move_tail(&cnode->lru, &skipped);
+        continue;
+      }
+      if (READ_ONCE(cnode->referenced)) {
+        WRITE_ONCE(cnode->referenced, false);
+        list_move_tail(&cnode->lru, &skipped);
+        continue;
+      }
+      list_move_tail(&cnode->lru, &skipped);
+      *victim = cnode->ino;
+      found = true;
+      break;
+    }
+    list_splice_tail_init(&skipped, &info->cache_lru);
+  }
+  spin_unlock(&info->cache_lock);
+
+  return found;
+}
+
+// nowait callers get -EAGAIN instead of waiting for an eviction
+int vtfs_cache_reserve(struct vtfs_fs_info* info, size_t bytes, ino_t self, bool nowait) {
+  ino_t victim, first_busy = 0;
+
+  if (!info || !info->cache || !info->cache_budget)
+    return 0;
+
+  if (bytes > info->cache_budget)
+    return -ENOSPC;
+
+  while (atomic_long_read(&info->data_bytes) + bytes > info->cache_budget) {
+    if (nowait)
+      return -EAGAIN;
+    if (!vtfs_cache_pick(info, self, &victim))
+      return -ENOSPC;
+
+    if (vtfs_cache_evict(info, victim)) {
+      atomic64_inc(&info->cache_evictions);
+      first_busy = 0;
+      continue;
+    }
+
+    // busy victims go round to the tail, meeting one again means all are busy
+    if (victim == first_busy)
+      return -ENOSPC;
+    if (!first_busy)
+      first_busy = victim;
+    cond_resched();
+  }
+  return 0;
+}
+
+// Takes the next due cnode off its slot and re-arms it one second later, so a
+// victim that turns out to be busy is retried on the next tick; an evicted one
+// leaves the wheel in vtfs_cache_forget. The wheel is advanced one slot per
+// second; after a long stall a single full turn covers every slot.
+static bool vtfs_cache_next_expired(struct vtfs_fs_info* info, time64_t now, ino_t* ino) {
+  struct vtfs_cnode* cnode;
+
+  spin_lock(&info->cache_lock);
+  if (now - info->cache_tick >= VTFS_WHEEL_SLOTS)
+    info->cache_tick = now - VTFS_WHEEL_SLOTS + 1;
+
+  while (info->cache_tick <= now) {
+    struct list_head* slot = &info->cache_wheel[info->cache_tick % VTFS_WHEEL_SLOTS];
+
+    list_for_each_entry(cnode, slot, wheel) {
+      if (cnode->expires > now)
+        continue;  // due on a later turn of the wheel
+
+      cnode->expires = now + 1;
+      list_move_tail(&cnode->wheel, &info->cache_wheel[cnode->expires % VTFS_WHEEL_SLOTS]);
+      *ino = cnode->ino;
+      spin_unlock(&info->cache_lock);
+      return true;
+    }
+    info->cache_tick++;
+  }
+  spin_unlock(&info->cache_lock);
+  return false;
+}
+
+static void vtfs_cache_wheel_work(struct work_struct* work) {
+  struct vtfs_fs_info* info = container_of(to_delayed_work(work), struct vtfs_fs_info, cache_work);
+  time64_t now = ktime_get_seconds();
+  ino_t ino;
+
+  while (vtfs_cache_next_expired(info, now, &ino)) {
+    if (vtfs_cache_evict(info, ino))
+      atomic64_inc(&info->cache_expired);
+    cond_resched();
+  }
+
+  if (READ_ONCE(info->cache_ttls))
+    schedule_delayed_work(&info->cache_work, HZ);
+}
+
+int vtfs_cache_set_ttl(struct vtfs_fs_info* info, struct inode* inode, u64 seconds) {
+  struct vtfs_file* file = vtfs_get_file_by_inode(inode);
+  struct vtfs_cnode* cnode;
+  time64_t now = ktime_get_seconds();
+
+  if (!info->cache)
+    return -EOPNOTSUPP;
+
+  if (!file || !file->cnode)
+    return -EINVAL;
+
+  cnode = file->cnode;
+
+  spin_lock(&info->cache_lock);
+  vtfs_cache_unwheel(info, cnode);
+  cnode->expires = 0;
+  // the worker was idle, start the wheel at the present
+  if (!info->cache_ttls)
+    info->cache_tick = now;
+  if (seconds) {
+    cnode->expires = now + min_t(u64, seconds, S64_MAX - now);
+    list_add_tail(&cnode->wheel, &info->cache_wheel[cnode->expires % VTFS_WHEEL_SLOTS]);
+    info->cache_ttls++;
+  }
+  spin_unlock(&info->cache_lock);
+
+  // no-op while the worker is already queued
+  if (seconds)
+    schedule_delayed_work(&info->cache_work, HZ);
+  return 0;
+}
+
+void vtfs_cache_destroy(struct vtfs_fs_info* info) {
+  cancel_delayed_work_sync(&info->cache_work);
+}
+
+// names of evicted or expired inodes disappear behind the dcache's back
+static int vtfs_d_revalidate(struct dentry* dentry, unsigned int flags) {
+  struct vtfs_fs_info* info = dentry->d_sb->s_fs_info;
+  struct inode* inode = d_inode_rcu(dentry);
+
+  if (!inode || inode->i_ino == VTFS_ROOT_INO || !info)
+    return 1;
+
+  return xa_load(&info->inodes, inode->i_ino) != NULL;
+}
+
+const struct dentry_operations vtfs_dentry_ops = {
+    .d_revalidate = vtfs_d_revalidate,
+};
@@ -0,0 +1,173 @@
+#include <linux/mm.h>
+#include <linux/nodemask.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/topology.h>
+#include <linux/xarray.h>
+
+#include "vtfs.h"
+
+// nearest allowed node to the one we are running on
+static int vtfs_nearest_node(const nodemask_t* nodes) {
+  int local = numa_node_id();
+  int best = NUMA_NO_NODE;
+  int best_dist = INT_MAX;
+  int nid;
+
+  if (node_isset(local, *nodes))
+    return local;
+
+  for_each_node_mask(nid, *nodes) {
+    int dist = node_distance(local, nid);
+    if (dist < best_dist) {
+      best_dist = dist;
+      best = nid;
+    }
+  }
+  return best;
+}
+
+// interleave rotor is per-CPU so parallel writers never share a cacheline
+static int vtfs_interleave_node(struct vtfs_fs_info* info) {
+  int* last = get_cpu_ptr(info->mpol_rotor);
+  int nid = next_node_in(*last, info->mpol_nodes);
+
+  *last = nid;
+  put_cpu_ptr(info->mpol_rotor);
+  return nid;
+}
+
+int vtfs_data_node(struct vtfs_fs_info* info) {
+  if (!info)
+    return NUMA_NO_NODE;
+
+  switch (info->mpol) {
+    case VTFS_MPOL_LOCAL:
+      return numa_node_id();
+    case VTFS_MPOL_BIND:
+      return vtfs_nearest_node(&info->mpol_nodes);
+    case VTFS_MPOL_INTERLEAVE:
+      return vtfs_interleave_node(info);
+    default:
+      return NUMA_NO_NODE;
+  }
+}
+
+static void vtfs_data_account(struct vtfs_fs_info* info, const void* data, long delta) {
+  if (!info || !info->node_bytes || !data || !delta)
+    return;
+
+  atomic_long_add(delta, &info->node_bytes[page_to_nid(virt_to_page(data))]);
+  atomic_long_add(delta, &info->data_bytes);
+}
+
+static char* vtfs_data_alloc(struct vtfs_fs_info* info, size_t size, gfp_t gfp) {
+  int nid = vtfs_data_node(info);
+  char* data;
+
+  if (!info || info->mpol != VTFS_MPOL_BIND)
+    return kmalloc_node(size, gfp, nid);
+
+  // bind is strict: walk the allowed nodes instead of falling back anywhere
+  data = kmalloc_node(size, gfp | __GFP_THISNODE | __GFP_NOWARN, nid);
+  if (!data) {
+    int other;
+
+    for_each_node_mask(other, info->mpol_nodes) {
+      if (other == nid)
+        continue;
+      data = kmalloc_node(size, gfp | __GFP_THISNODE | __GFP_NOWARN, other);
+      if (data)
+        break;
+    }
+  }
+  return data;
+}
+
+// Buffers shared copy-on-write with snapshots: data_refs maps the buffer
+// address to the number of extra inodes owning it. A buffer that is not in
+// there belongs to exactly one inode (and its hard links).
+int vtfs_data_share(struct vtfs_fs_info* info, char* data) {
+  void* entry;
+  unsigned long refs;
+  int err;
+
+  xa_lock(&info->data_refs);
+  entry = xa_load(&info->data_refs, (unsigned long)data);
+  refs = entry ? xa_to_value(entry) : 0;
+  err = xa_err(__xa_store(&info->data_refs, (unsigned long)data, xa_mk_value(refs + 1), GFP_KERNEL));
+  xa_unlock(&info->data_refs);
+  return err;
+}
+
+static bool vtfs_data_shared(struct vtfs_fs_info* info, char* data) {
+  return info && xa_load(&info->data_refs, (unsigned long)data);
+}
+
+// drops one extra owner; false when the caller holds the last reference
+static bool vtfs_data_unshare(struct vtfs_fs_info* info, char* data) {
+  void* entry;
+  unsigned long refs;
+
+  if (!info)
+    return false;
+
+  xa_lock(&info->data_refs);
+  entry = xa_load(&info->data_refs, (unsigned long)data);
+  if (!entry) {
+    xa_unlock(&info->data_refs);
+    return false;
+  }
+
+  refs = xa_to_value(entry);
+  if (refs > 1)
+    __xa_store(&info->data_refs, (unsigned long)data, xa_mk_value(refs - 1), GFP_ATOMIC);
+  else
+    __xa_erase(&info->data_refs, (unsigned long)data);
+  xa_unlock(&info->data_refs);
+  return true;
+}
+
+// gfp is GFP_NOWAIT for IOCB_NOWAIT writes, GFP_KERNEL otherwise
+char* vtfs_data_realloc(
+    struct vtfs_fs_info* info, char* old, size_t old_size, size_t new_size, gfp_t gfp
+) {
+  char* data;
+
+  // the slab object behind old is at least kmalloc_size_roundup(old_size) bytes;
+  // a shared buffer is never written in place
+  if (old && new_size <= kmalloc_size_roundup(old_size) && !vtfs_data_shared(info, old)) {
+    vtfs_data_account(info, old, (long)new_size - (long)old_size);
+    return old;
+  }
+
+  data = vtfs_data_alloc(info, new_size, gfp);
+  if (!data)
+    return NULL;
+
+  if (old) {
+    memcpy(data, old, min(old_size, new_size));
+    vtfs_data_free(info, old, old_size);
+  }
+
+  vtfs_data_account(info, data, new_size);
+  return data;
+}
+
+// drop the accounting only, the caller takes care of the memory itself
+void vtfs_data_forget(struct vtfs_fs_info* info, char* data, size_t size) {
+  vtfs_data_account(info, data, -(long)size);
+}
+
+// true when someone else still owns the buffer and it must stay
+bool vtfs_data_release(struct vtfs_fs_info* info, char* data) {
+  return vtfs_data_unshare(info, data);
+}
+
+void vtfs_data_free(struct vtfs_fs_info* info, char* data, size_t size) {
+  if (!data || vtfs_data_release(info, data))
+    return;
+
+  vtfs_data_forget(info, data, size);
+  kfree(data);
+}
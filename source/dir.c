@@ -17,8 +17,9 @@ int vtfs_iterate(struct file* filp, struct dir_context* ctx) {
   }
 
   if (ctx->pos == 1) {
-    ino_t pino = VTFS_ROOT_INO; 
-    // ino_t pino = inode->i_ino;
+    struct vtfs_dir* parent = READ_ONCE(dir->parent);
+    ino_t pino = parent ? parent->ino : VTFS_ROOT_INO;
+
     if (!dir_emit(ctx, "..", 2, pino, DT_DIR))
       return 0;
     ctx->pos = 2;
@@ -29,9 +30,12 @@ int vtfs_iterate(struct file* filp, struct dir_context* ctx) {
     if (index++ < ctx->pos - 2)
       continue;
 
-    if (!dir_emit(
-            ctx, file->name, strlen(file->name), file->ino, S_ISDIR(file->mode) ? DT_DIR : DT_REG
-        ))
+    if (file->flags & VTFS_F_HIDDEN) {
+      ctx->pos++;
+      continue;
+    }
+
+    if (!dir_emit(ctx, file->name, strlen(file->name), file->ino, S_DT(file->mode)))
       break;
 
     ctx->pos++;
@@ -0,0 +1,90 @@
+#include <linux/exportfs.h>
+
+#include "vtfs.h"
+
+// Handles carry the 64-bit inode number and its generation, optionally
+// followed by the parent's: { ino_lo, ino_hi, gen [, pino_lo, pino_hi, pgen] }.
+// Resolving one is an xarray lookup, the tree is never walked.
+
+#define VTFS_FILEID_INO64_GEN 0x81
+#define VTFS_FILEID_INO64_GEN_PARENT 0x82
+
+#define VTFS_FH_LEN 3
+#define VTFS_FH_LEN_PARENT 6
+
+static void vtfs_fh_put(__u32* fh, const struct inode* inode) {
+  fh[0] = (u32)inode->i_ino;
+  fh[1] = (u32)((u64)inode->i_ino >> 32);
+  fh[2] = inode->i_generation;
+}
+
+static int vtfs_encode_fh(struct inode* inode, __u32* fh, int* max_len, struct inode* parent) {
+  int len = parent ? VTFS_FH_LEN_PARENT : VTFS_FH_LEN;
+
+  if (*max_len < len) {
+    *max_len = len;
+    return FILEID_INVALID;
+  }
+
+  vtfs_fh_put(fh, inode);
+  if (parent)
+    vtfs_fh_put(fh + VTFS_FH_LEN, parent);
+
+  *max_len = len;
+  return parent ? VTFS_FILEID_INO64_GEN_PARENT : VTFS_FILEID_INO64_GEN;
+}
+
+static struct dentry* vtfs_fh_dentry(struct super_block* sb, const __u32* fh) {
+  ino_t ino = (ino_t)((u64)fh[1] << 32 | fh[0]);
+  struct inode* inode = vtfs_iget(sb, ino);
+
+  if (IS_ERR(inode))
+    return ERR_CAST(inode);
+
+  // inode numbers are never reused, the generation still guards against a
+  // handle from an earlier mount
+  if (ino != VTFS_ROOT_INO && inode->i_generation != fh[2]) {
+    iput(inode);
+    return ERR_PTR(-ESTALE);
+  }
+
+  return d_obtain_alias(inode);
+}
+
+static struct dentry* vtfs_fh_to_dentry(
+    struct super_block* sb, struct fid* fid, int fh_len, int fh_type
+) {
+  if ((fh_type != VTFS_FILEID_INO64_GEN && fh_type != VTFS_FILEID_INO64_GEN_PARENT) ||
+      fh_len < VTFS_FH_LEN)
+    return NULL;
+
+  return vtfs_fh_dentry(sb, fid->raw);
+}
+
+static struct dentry* vtfs_fh_to_parent(
+    struct super_block* sb, struct fid* fid, int fh_len, int fh_type
+) {
+  if (fh_type != VTFS_FILEID_INO64_GEN_PARENT || fh_len < VTFS_FH_LEN_PARENT)
+    return NULL;
+
+  return vtfs_fh_dentry(sb, fid->raw + VTFS_FH_LEN);
+}
+
+static struct dentry* vtfs_get_parent(struct dentry* child) {
+  struct super_block* sb = child->d_sb;
+  struct vtfs_dir* dir = vtfs_get_dir(sb, d_inode(child));
+  struct vtfs_dir* parent;
+
+  if (!dir)
+    return ERR_PTR(-ESTALE);
+
+  parent = READ_ONCE(dir->parent);
+  return d_obtain_alias(vtfs_iget(sb, parent ? parent->ino : VTFS_ROOT_INO));
+}
+
+const struct export_operations vtfs_export_ops = {
+    .encode_fh = vtfs_encode_fh,
+    .fh_to_dentry = vtfs_fh_to_dentry,
+    .fh_to_parent = vtfs_fh_to_parent,
+    .get_parent = vtfs_get_parent,
+};
@@ -1,86 +1,235 @@
+#include <linux/fs.h>
 #include <linux/printk.h>
+#include <linux/uio.h>
 
 #include "vtfs.h"
 
 int vtfs_open(struct inode* inode, struct file* filp) {
-  if (filp->f_flags & O_TRUNC) {
+  struct vtfs_fs_info* info = inode->i_sb->s_fs_info;
+
+  // an open of an existing cached file is a hit, misses are failed lookups;
+  // O_CREAT that made the file was already counted as a miss
+  if (info && info->cache && !(filp->f_mode & FMODE_CREATED)) {
+    vtfs_cache_touch(vtfs_get_file_by_inode(inode));
+    atomic64_inc(&info->cache_hits);
+  }
+
+  // O_TRUNC truncates even a read-only open
+  if ((filp->f_mode & FMODE_WRITE) || (filp->f_flags & O_TRUNC)) {
     struct vtfs_file* file = vtfs_get_file_by_inode(inode);
-    if (file && file->data) {
+
+    if (file && (file->flags & VTFS_F_SNAPSHOT))
+      return -EROFS;
+  }
+
+  // RWF_NOWAIT and inline io_uring completion, see vtfs_read_iter/vtfs_write_iter
+  filp->f_mode |= FMODE_NOWAIT | FMODE_BUF_WASYNC;
+
+  if (filp->f_flags & O_TRUNC) {
+    struct vtfs_file* file;
+
+    // readers hold it shared while they copy out of the buffer
+    inode_lock(inode);
+    file = vtfs_get_file_by_inode(inode);
+    if (file && file->shm) {
+      vtfs_shm_truncate(file->shm);
+      if (info)
+        vtfs_update_data_all(info, inode->i_ino, NULL, NULL, 0);
+      file->data_size = 0;
+      inode->i_size = 0;
+      vtfs_usage_charge(info, inode->i_ino, 0);
+    } else if (file && file->data) {
       char* old = file->data;
-      struct vtfs_fs_info* info = inode->i_sb->s_fs_info;
+      size_t old_size = file->data_size;
 
       if (info) {
-        vtfs_update_data_all(&info->root_dir, inode->i_ino, old, NULL, 0);
+        vtfs_update_data_all(info, inode->i_ino, old, NULL, 0);
       }
 
-      kfree(old);
+      vtfs_data_free_async(info, old, old_size);
       file->data = NULL;
       file->data_size = 0;
       inode->i_size = 0;
+      vtfs_usage_charge(info, inode->i_ino, 0);
     }
+    inode_unlock(inode);
   }
   return 0;
 }
 
-ssize_t vtfs_read(struct file* filp, char __user* buffer, size_t len, loff_t* offset) {
-  struct inode* inode = filp->f_inode;
-  struct vtfs_file* file = vtfs_get_file_by_inode(inode);
-  size_t to_read;
+// IOCB_NOWAIT (io_uring, RWF_NOWAIT): complete inline only when nothing has to
+// sleep, i.e. the inode lock is free, data is resident and no allocation or
+// eviction is needed; -EAGAIN otherwise and the caller retries from a worker.
+static bool vtfs_lock_inode(struct inode* inode, bool shared, bool nowait) {
+  if (nowait)
+    return shared ? inode_trylock_shared(inode) : inode_trylock(inode);
+
+  if (shared)
+    inode_lock_shared(inode);
+  else
+    inode_lock(inode);
+  return true;
+}
 
-  if (!file || !file->data)
-    return 0;
+ssize_t vtfs_read_iter(struct kiocb* iocb, struct iov_iter* to) {
+  struct inode* inode = file_inode(iocb->ki_filp);
+  struct vtfs_fs_info* info = inode->i_sb->s_fs_info;
+  bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+  struct vtfs_file* file;
+  loff_t pos = iocb->ki_pos;
+  size_t count;
+  ssize_t ret;
 
-  if (*offset >= file->data_size)
+  if (!iov_iter_count(to))
     return 0;
 
-  to_read = min(len, file->data_size - *offset);
+  // writers replace the buffer under the exclusive lock
+  if (!vtfs_lock_inode(inode, true, nowait))
+    return -EAGAIN;
 
-  if (copy_to_user(buffer, file->data + *offset, to_read))
-    return -EFAULT;
+  file = vtfs_get_file_by_inode(inode);
+  if (!file || (!file->data && !file->shm) || pos >= file->data_size) {
+    ret = 0;
+    goto out;
+  }
+
+  count = min_t(size_t, iov_iter_count(to), file->data_size - pos);
+  vtfs_cache_touch(file);
+
+  // every segment of a readv is filled in this one pass
+  if (file->shm) {
+    ret = vtfs_shm_read(info, file->shm, to, count, pos, nowait);
+  } else {
+    ret = copy_to_iter(file->data + pos, count, to);
+    if (!ret)
+      ret = -EFAULT;
+  }
 
-  *offset += to_read;
-  return to_read;
+  if (ret > 0)
+    iocb->ki_pos += ret;
+out:
+  inode_unlock_shared(inode);
+  return ret;
 }
 
-ssize_t vtfs_write(struct file* filp, const char __user* buffer, size_t len, loff_t* offset) {
-  struct inode* inode = filp->f_inode;
-  struct vtfs_file* file = vtfs_get_file_by_inode(inode);
+static ssize_t vtfs_shm_write_file(
+    struct kiocb* iocb, struct vtfs_file* file, struct iov_iter* from, bool nowait
+) {
+  struct inode* inode = file_inode(iocb->ki_filp);
   struct vtfs_fs_info* info = inode->i_sb->s_fs_info;
-  char* new_data;
-  char* old_data;
   size_t new_size;
+  ssize_t ret;
+
+  ret = vtfs_shm_write(info, file->shm, from, iov_iter_count(from), iocb->ki_pos, nowait);
+  if (ret <= 0)
+    return ret;
 
-  if (!file)
-    return -ENOENT;
+  iocb->ki_pos += ret;
+  new_size = max_t(size_t, file->data_size, iocb->ki_pos);
 
-  if (filp->f_flags & O_APPEND)
-    *offset = file->data_size;
+  if (info && file->nlink > 1)
+    vtfs_update_data_all(info, inode->i_ino, NULL, NULL, new_size);
+  else
+    file->data_size = new_size;
 
-  old_data = file->data;
-  new_size = *offset + len;
+  inode->i_size = new_size;
+  vtfs_usage_charge(info, inode->i_ino, new_size);
+  return ret;
+}
 
-  new_data = krealloc(old_data, new_size, GFP_KERNEL);
+static ssize_t vtfs_data_write_file(
+    struct kiocb* iocb, struct vtfs_file* file, struct iov_iter* from, bool nowait
+) {
+  struct inode* inode = file_inode(iocb->ki_filp);
+  struct vtfs_fs_info* info = inode->i_sb->s_fs_info;
+  size_t len = iov_iter_count(from);
+  loff_t pos = iocb->ki_pos;
+  char* old_data = file->data;
+  size_t old_size = file->data_size;
+  // writing inside the file never shrinks it
+  size_t new_size = max_t(size_t, old_size, pos + len);
+  size_t size;
+  char* new_data;
+  size_t copied;
+  int err;
+
+  // make room by evicting other files first, this one is never the victim
+  if (new_size > old_size) {
+    err = vtfs_cache_reserve(info, new_size - old_size, inode->i_ino, nowait);
+    if (err)
+      return err;
+  }
+  vtfs_cache_touch(file);
+
+  new_data = vtfs_data_realloc(info, old_data, old_size, new_size, nowait ? GFP_NOWAIT : GFP_KERNEL);
   if (!new_data)
-    return -ENOMEM;
+    return nowait ? -EAGAIN : -ENOMEM;
 
-  if (file->data_size < *offset)
-    memset(new_data + file->data_size, 0, *offset - file->data_size);
+  if (old_size < pos)
+    memset(new_data + old_size, 0, pos - old_size);
 
-  if (info && file->nlink > 1) {
-    vtfs_update_data_all(&info->root_dir, inode->i_ino, old_data, new_data, new_size);
+  // all segments of a writev in one pass
+  copied = copy_from_iter(new_data + pos, len, from);
 
-    file = vtfs_get_file_by_inode(inode);
-    if (!file)
-      return -ENOENT;
+  // A fault part way must not expose the uninitialised tail. The buffer is
+  // only ever larger than data_size, so it stays where it is; only the
+  // accounting shrinks, nothing here may allocate or free on the nowait path.
+  size = copied ? max_t(size_t, old_size, pos + copied) : old_size;
+  if (size < new_size)
+    vtfs_data_forget(info, new_data, new_size - size);
+
+  if (info && file->nlink > 1) {
+    vtfs_update_data_all(info, inode->i_ino, old_data, new_data, size);
   } else {
     file->data = new_data;
-    file->data_size = new_size;
+    file->data_size = size;
   }
 
-  if (copy_from_user(file->data + *offset, buffer, len))
+  if (!copied)
     return -EFAULT;
 
-  *offset += len;
-  inode->i_size = file->data_size;
-  return len;
+  iocb->ki_pos += copied;
+  inode->i_size = size;
+  vtfs_usage_charge(info, inode->i_ino, size);
+  return copied;
+}
+
+ssize_t vtfs_write_iter(struct kiocb* iocb, struct iov_iter* from) {
+  struct inode* inode = file_inode(iocb->ki_filp);
+  bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+  struct vtfs_file* file;
+  ssize_t ret;
+
+  if (!vtfs_lock_inode(inode, false, nowait))
+    return -EAGAIN;
+
+  file = vtfs_get_file_by_inode(inode);
+  if (!file) {
+    ret = -ENOENT;
+    goto out;
+  }
+
+  if (file->flags & VTFS_F_SNAPSHOT) {
+    ret = -EROFS;
+    goto out;
+  }
+
+  // O_APPEND, s_maxbytes and RLIMIT_FSIZE; IOCB_NOWAIT passes thanks to
+  // FMODE_BUF_WASYNC
+  ret = generic_write_checks(iocb, from);
+  if (ret <= 0)
+    goto out;
+
+  // drops suid/sgid and updates mtime, -EAGAIN if that would block
+  ret = kiocb_modified(iocb);
+  if (ret)
+    goto out;
+
+  if (file->shm)
+    ret = vtfs_shm_write_file(iocb, file, from, nowait);
+  else
+    ret = vtfs_data_write_file(iocb, file, from, nowait);
+out:
+  inode_unlock(inode);
+  return ret;
 }
@@ -3,33 +3,92 @@
 
 #include "vtfs.h"
 
-struct inode* vtfs_get_inode(
-    struct super_block* sb, const struct inode* dir, umode_t mode, ino_t ino
-) {
-  struct inode* inode = new_inode(sb);
-  if (!inode)
-    return NULL;
-
-  inode->i_ino = ino;
+static void vtfs_init_inode(struct inode* inode, kuid_t uid, kgid_t gid, umode_t mode) {
   inode->i_mode = mode;
-  inode->i_uid = dir ? dir->i_uid : GLOBAL_ROOT_UID;
-  inode->i_gid = dir ? dir->i_gid : GLOBAL_ROOT_GID;
+  inode->i_uid = uid;
+  inode->i_gid = gid;
 
   inode->i_op = &vtfs_inode_ops;
 
   if (S_ISDIR(mode)) {
     inode->i_fop = &vtfs_dir_ops;
     set_nlink(inode, 2);
-  } else {
+  } else if (S_ISREG(mode)) {
     inode->i_fop = &vtfs_file_ops;
     set_nlink(inode, 1);
     inode->i_size = 0;
+  } else {
+    // only whiteouts left by rename(RENAME_WHITEOUT) end up here
+    init_special_inode(inode, mode, WHITEOUT_DEV);
+    set_nlink(inode, 1);
   }
+}
+
+struct inode* vtfs_get_inode(
+    struct super_block* sb, const struct inode* dir, umode_t mode, ino_t ino
+) {
+  struct inode* inode = new_inode(sb);
+  if (!inode)
+    return NULL;
 
+  inode->i_ino = ino;
+  vtfs_init_inode(inode, dir ? dir->i_uid : GLOBAL_ROOT_UID, dir ? dir->i_gid : GLOBAL_ROOT_GID, mode);
+  return inode;
+}
+
+// inode cache lookup by number; a new inode is filled from the ino index, so
+// it looks the same whether it came from a lookup, a file handle or eviction
+struct inode* vtfs_iget(struct super_block* sb, ino_t ino) {
+  struct vtfs_fs_info* info = sb->s_fs_info;
+  struct vtfs_file* file;
+  struct inode* inode;
+  umode_t mode = 0;
+  size_t size = 0;
+  unsigned int nlink = 0;
+  u32 generation = 0;
+  kuid_t uid = GLOBAL_ROOT_UID;
+  kgid_t gid = GLOBAL_ROOT_GID;
+
+  if (ino == VTFS_ROOT_INO)
+    return igrab(d_inode(sb->s_root));
+
+  inode = iget_locked(sb, ino);
+  if (!inode)
+    return ERR_PTR(-ENOMEM);
+  if (!(inode->i_state & I_NEW))
+    return inode;
+
+  // entries are dropped from the index before being freed
+  xa_lock(&info->inodes);
+  file = xa_load(&info->inodes, ino);
+  if (file) {
+    mode = file->mode;
+    size = file->data_size;
+    nlink = file->nlink;
+    generation = file->generation;
+    uid = file->uid;
+    gid = file->gid;
+  }
+  xa_unlock(&info->inodes);
+
+  if (!file) {
+    iget_failed(inode);
+    return ERR_PTR(-ESTALE);
+  }
+
+  vtfs_init_inode(inode, uid, gid, mode);
+  if (S_ISREG(mode))
+    inode->i_size = size;
+  if (!S_ISDIR(mode))
+    set_nlink(inode, nlink);
+  inode->i_generation = generation;
+
+  unlock_new_inode(inode);
   return inode;
 }
 
 struct dentry* vtfs_lookup(struct inode* parent, struct dentry* dentry, unsigned int flags) {
+  struct vtfs_fs_info* info = parent->i_sb->s_fs_info;
   struct vtfs_dir* dir = vtfs_get_dir(parent->i_sb, parent);
   struct vtfs_file* file;
   struct inode* inode;
@@ -41,18 +100,16 @@ struct dentry* vtfs_lookup(struct inode* parent, struct dentry* dentry, unsigned
   file = vtfs_find_file(dir, dentry->d_name.name);
   if (!file) {
     up_read(&dir->sem);
+    if (info && info->cache)
+      atomic64_inc(&info->cache_misses);
     return NULL;
   }
 
-  inode = vtfs_get_inode(parent->i_sb, parent, file->mode, file->ino);
-  if (S_ISREG(file->mode))
-    inode->i_size = file->data_size;
-
-  set_nlink(inode, file->nlink);
-
+  inode = vtfs_iget(parent->i_sb, file->ino);
   up_read(&dir->sem);
-  d_add(dentry, inode);
-  return NULL;
+
+  // a directory may already have a disconnected alias from an NFS handle
+  return d_splice_alias(inode, dentry);
 }
 
 int vtfs_create(
@@ -61,25 +118,57 @@ int vtfs_create(
   struct vtfs_fs_info* info = parent->i_sb->s_fs_info;
   struct vtfs_dir* dir = vtfs_get_dir(parent->i_sb, parent);
   struct vtfs_file* file;
+  struct file* shm = NULL;
+  struct vtfs_cnode* cnode;
   struct inode* inode;
+  ino_t ino;
 
   if (!info || !dir)
     return -ENOENT;
 
+  if (dir->readonly)
+    return -EROFS;
+
+  ino = vtfs_alloc_ino(info);
+  if (info->storage == VTFS_STORAGE_SHMEM) {
+    shm = vtfs_shm_create(info, ino);
+    if (IS_ERR(shm))
+      return PTR_ERR(shm);
+  }
+
+  cnode = vtfs_cache_attach(info, ino);
+  if (IS_ERR(cnode)) {
+    vtfs_shm_put(info, ino, shm);
+    return PTR_ERR(cnode);
+  }
+
   down_write(&dir->sem);
 
   if (vtfs_find_file(dir, dentry->d_name.name)) {
     up_write(&dir->sem);
+    vtfs_shm_put(info, ino, shm);
+    vtfs_cache_forget(info, cnode);
     return -EEXIST;
   }
 
-  file = vtfs_create_file(dir, dentry->d_name.name, S_IFREG | mode, info->next_ino++);
+  file = vtfs_create_file(info, dir, parent, dentry->d_name.name, S_IFREG | mode, ino);
+  if (file) {
+    file->shm = shm;
+    file->cnode = cnode;
+    vtfs_usage_link(info, file);
+  }
   up_write(&dir->sem);
 
-  if (!file)
+  if (!file) {
+    vtfs_shm_put(info, ino, shm);
+    vtfs_cache_forget(info, cnode);
     return -ENOMEM;
+  }
+
+  inode = vtfs_iget(parent->i_sb, ino);
+  if (IS_ERR(inode))
+    return PTR_ERR(inode);
 
-  inode = vtfs_get_inode(parent->i_sb, parent, file->mode, file->ino);
   d_add(dentry, inode);
   return 0;
 }
@@ -89,10 +178,14 @@ int vtfs_mkdir(struct mnt_idmap* idmap, struct inode* parent, struct dentry* den
   struct vtfs_dir* dir = vtfs_get_dir(parent->i_sb, parent);
   struct vtfs_file* file;
   struct inode* inode;
+  ino_t ino;
 
   if (!info || !dir)
     return -ENOENT;
 
+  if (dir->readonly)
+    return -EROFS;
+
   down_write(&dir->sem);
 
   if (vtfs_find_file(dir, dentry->d_name.name)) {
@@ -100,15 +193,18 @@ int vtfs_mkdir(struct mnt_idmap* idmap, struct inode* parent, struct dentry* den
     return -EEXIST;
   }
 
-  file = vtfs_create_file(dir, dentry->d_name.name, S_IFDIR | mode, info->next_ino++);
+  file = vtfs_create_file(info, dir, parent, dentry->d_name.name, S_IFDIR | mode, vtfs_alloc_ino(info));
+  ino = file ? file->ino : 0;
+  if (file)
+    vtfs_usage_link(info, file);
   up_write(&dir->sem);
 
   if (!file)
     return -ENOMEM;
 
-  inode = vtfs_get_inode(parent->i_sb, parent, file->mode, file->ino);
-  if (!inode)
-    return -ENOMEM;
+  inode = vtfs_iget(parent->i_sb, ino);
+  if (IS_ERR(inode))
+    return PTR_ERR(inode);
 
   d_add(dentry, inode);
   inc_nlink(parent);
@@ -117,11 +213,15 @@ int vtfs_mkdir(struct mnt_idmap* idmap, struct inode* parent, struct dentry* den
 
 int vtfs_rmdir(struct inode* parent, struct dentry* dentry) {
   struct vtfs_dir* dir = vtfs_get_dir(parent->i_sb, parent);
+  struct vtfs_fs_info* info = parent->i_sb->s_fs_info;
   struct vtfs_file* file;
 
   if (!dir)
     return -ENOENT;
 
+  if (dir->readonly)
+    return -EROFS;
+
   down_write(&dir->sem);
   file = vtfs_find_file(dir, dentry->d_name.name);
 
@@ -138,6 +238,7 @@ int vtfs_rmdir(struct inode* parent, struct dentry* dentry) {
   list_del(&file->list);
   up_write(&dir->sem);
 
+  vtfs_index_forget(info, file, 0);
   kfree(file->dir_data);
   kfree(file);
 
@@ -161,6 +262,9 @@ int vtfs_link(struct dentry* old, struct inode* parent, struct dentry* new) {
   if (!dir || !inode)
     return -ENOENT;
 
+  if (dir->readonly)
+    return -EROFS;
+
   if (S_ISDIR(inode->i_mode)) {
     return -EPERM;
   }
@@ -169,6 +273,10 @@ int vtfs_link(struct dentry* old, struct inode* parent, struct dentry* new) {
   if (!src)
     return -ENOENT;
 
+  // snapshot data is only shared through its own reference counting
+  if (src->flags & VTFS_F_SNAPSHOT)
+    return -EXDEV;
+
   down_write(&dir->sem);
 
   if (vtfs_find_file(dir, name)) {
@@ -183,22 +291,37 @@ int vtfs_link(struct dentry* old, struct inode* parent, struct dentry* new) {
   }
 
   INIT_LIST_HEAD(&new_file->list);
+  INIT_LIST_HEAD(&new_file->links);
   new_file->ino = src->ino;
   new_file->mode = src->mode;
   strscpy(new_file->name, name, VTFS_MAX_NAME - 1);
   new_file->name[VTFS_MAX_NAME - 1] = '\0';
   new_file->dir_data = NULL;
+  new_file->parent = dir;
+  new_file->generation = src->generation;
+  new_file->uid = src->uid;
+  new_file->gid = src->gid;
+  // every name of a buffer shared with a snapshot has to know it
+  new_file->flags = src->flags & VTFS_F_COW;
   new_file->data = src->data;
   new_file->data_size = src->data_size;
+  new_file->shm = src->shm;
+  new_file->cnode = src->cnode;
 
   src->nlink++;
   new_file->nlink = src->nlink;
 
   list_add_tail(&new_file->list, &dir->files);
+  if (info) {
+    spin_lock(&info->links_lock);
+    list_add_tail(&new_file->links, &src->links);
+    spin_unlock(&info->links_lock);
+    vtfs_usage_link(info, new_file);
+  }
   up_write(&dir->sem);
 
   if (info)
-    vtfs_update_nlink_all(&info->root_dir, src->ino, src->nlink);
+    vtfs_update_nlink_all(info, src->ino, src->nlink);
 
   set_nlink(inode, src->nlink);
 
@@ -216,14 +339,14 @@ int vtfs_unlink(struct inode* parent, struct dentry* dentry) {
   const char* name;
   ino_t ino;
   unsigned int new_nlink;
-
-  char* data_to_free = NULL;
-  struct vtfs_dir* dir_data_to_free = NULL;
   bool should_free_data = false;
 
   if (!dir || !inode)
     return -ENOENT;
 
+  if (dir->readonly)
+    return -EROFS;
+
   name = dentry->d_name.name;
   ino = inode->i_ino;
 
@@ -242,32 +365,216 @@ int vtfs_unlink(struct inode* parent, struct dentry* dentry) {
     return -ENOENT;
   }
 
-  if (should_free_data) {
-    data_to_free = file->data;
-    dir_data_to_free = file->dir_data;
-  }
-
   list_del(&file->list);
   up_write(&dir->sem);
 
-  kfree(file);
+  vtfs_index_forget(info, file, new_nlink);
 
-  if (info)
-    vtfs_update_nlink_all(&info->root_dir, ino, new_nlink);
+  // the last name is off the list already, only other names need the walk
+  if (info && new_nlink)
+    vtfs_update_nlink_all(info, ino, new_nlink);
 
   set_nlink(inode, new_nlink);
 
   if (should_free_data) {
-    if (info)
-      vtfs_remove_all_by_ino(&info->root_dir, ino);
-
-    if (dir_data_to_free) {
-      vtfs_cleanup_dir(dir_data_to_free);
-      kfree(dir_data_to_free);
+    if (file->dir_data) {
+      vtfs_free_subtree(info, file->dir_data);
+      kfree(file->dir_data);
     }
-    kfree(data_to_free);
+    vtfs_release_contents(info, file);
   }
+  kfree(file);
 
   d_drop(dentry);
   return 0;
 }
+
+static void vtfs_lock_dirs(struct vtfs_dir* a, struct vtfs_dir* b) {
+  if (a == b) {
+    down_write(&a->sem);
+    return;
+  }
+
+  if (a > b)
+    swap(a, b);
+
+  down_write(&a->sem);
+  down_write_nested(&b->sem, SINGLE_DEPTH_NESTING);
+}
+
+static void vtfs_unlock_dirs(struct vtfs_dir* a, struct vtfs_dir* b) {
+  up_write(&a->sem);
+  if (a != b)
+    up_write(&b->sem);
+}
+
+static void vtfs_drop_whiteout(struct vtfs_fs_info* info, struct vtfs_file* whiteout) {
+  if (!whiteout)
+    return;
+
+  xa_erase(&info->inodes, whiteout->ino);
+  kfree(whiteout);
+}
+
+// the entry replaced by rename() is already off its list; finish it like unlink/rmdir would
+static void vtfs_release_replaced(
+    struct vtfs_fs_info* info, struct inode* inode, struct vtfs_file* target
+) {
+  ino_t ino = target->ino;
+  unsigned int new_nlink;
+
+  if (target->dir_data) {
+    vtfs_index_forget(info, target, 0);
+    kfree(target->dir_data);
+    kfree(target);
+    if (inode)
+      clear_nlink(inode);
+    return;
+  }
+
+  new_nlink = (target->nlink > 0) ? (target->nlink - 1) : 0;
+  vtfs_index_forget(info, target, new_nlink);
+
+  if (new_nlink)
+    vtfs_update_nlink_all(info, ino, new_nlink);
+  else
+    vtfs_release_contents(info, target);
+
+  if (inode)
+    set_nlink(inode, new_nlink);
+  kfree(target);
+}
+
+int vtfs_rename(
+    struct mnt_idmap* idmap,
+    struct inode* old_dir,
+    struct dentry* old_dentry,
+    struct inode* new_dir,
+    struct dentry* new_dentry,
+    unsigned int flags
+) {
+  struct super_block* sb = old_dir->i_sb;
+  struct vtfs_fs_info* info = sb->s_fs_info;
+  struct vtfs_dir* odir = vtfs_get_dir(sb, old_dir);
+  struct vtfs_dir* ndir = vtfs_get_dir(sb, new_dir);
+  struct inode* old_inode = d_inode(old_dentry);
+  struct inode* new_inode = d_inode(new_dentry);
+  const char* old_name = old_dentry->d_name.name;
+  const char* new_name = new_dentry->d_name.name;
+  struct vtfs_file *src, *dst, *whiteout = NULL;
+  bool src_is_dir, dst_is_dir;
+
+  if (flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE | RENAME_WHITEOUT))
+    return -EINVAL;
+
+  if (!info || !odir || !ndir || !old_inode)
+    return -ENOENT;
+
+  if (odir->readonly || ndir->readonly)
+    return -EROFS;
+
+  if (new_dentry->d_name.len >= VTFS_MAX_NAME)
+    return -ENAMETOOLONG;
+
+  // allocate before taking the locks, the relink itself must not fail halfway
+  if (flags & RENAME_WHITEOUT) {
+    whiteout = kzalloc(sizeof(*whiteout), GFP_KERNEL);
+    if (!whiteout)
+      return -ENOMEM;
+
+    INIT_LIST_HEAD(&whiteout->list);
+    INIT_LIST_HEAD(&whiteout->links);
+    whiteout->ino = vtfs_alloc_ino(info);
+    whiteout->mode = S_IFCHR | WHITEOUT_MODE;
+    whiteout->nlink = 1;
+    whiteout->generation = vtfs_alloc_generation(info);
+    whiteout->parent = odir;
+    whiteout->uid = old_dir->i_uid;
+    whiteout->gid = old_dir->i_gid;
+    strscpy(whiteout->name, old_name, VTFS_MAX_NAME);
+
+    if (xa_insert(&info->inodes, whiteout->ino, whiteout, GFP_KERNEL)) {
+      kfree(whiteout);
+      return -ENOMEM;
+    }
+  }
+
+  vtfs_lock_dirs(odir, ndir);
+
+  src = vtfs_find_file(odir, old_name);
+  if (!src || src->ino != old_inode->i_ino) {
+    vtfs_unlock_dirs(odir, ndir);
+    vtfs_drop_whiteout(info, whiteout);
+    return -ENOENT;
+  }
+
+  dst = vtfs_find_file(ndir, new_name);
+  if (dst && (flags & RENAME_NOREPLACE)) {
+    vtfs_unlock_dirs(odir, ndir);
+    vtfs_drop_whiteout(info, whiteout);
+    return -EEXIST;
+  }
+
+  if (!dst && (flags & RENAME_EXCHANGE)) {
+    vtfs_unlock_dirs(odir, ndir);
+    vtfs_drop_whiteout(info, whiteout);
+    return -ENOENT;
+  }
+
+  if (dst && !(flags & RENAME_EXCHANGE) && dst->dir_data && !list_empty(&dst->dir_data->files)) {
+    vtfs_unlock_dirs(odir, ndir);
+    vtfs_drop_whiteout(info, whiteout);
+    return -ENOTEMPTY;
+  }
+
+  src_is_dir = S_ISDIR(src->mode);
+  dst_is_dir = dst && S_ISDIR(dst->mode);
+
+  if (flags & RENAME_EXCHANGE) {
+    strscpy(dst->name, old_name, VTFS_MAX_NAME);
+    if (odir != ndir) {
+      list_move_tail(&dst->list, &odir->files);
+      vtfs_usage_move(info, dst, odir);
+    }
+  } else if (dst) {
+    list_del(&dst->list);
+  }
+
+  // O(1) relink: the entry (and a whole subtree hanging off dir_data) moves as is
+  strscpy(src->name, new_name, VTFS_MAX_NAME);
+  if (odir != ndir) {
+    list_move_tail(&src->list, &ndir->files);
+    vtfs_usage_move(info, src, ndir);
+  }
+
+  if (whiteout)
+    list_add_tail(&whiteout->list, &odir->files);
+
+  vtfs_unlock_dirs(odir, ndir);
+
+  if (flags & RENAME_EXCHANGE) {
+    if (src_is_dir != dst_is_dir) {
+      if (src_is_dir) {
+        drop_nlink(old_dir);
+        inc_nlink(new_dir);
+      } else {
+        drop_nlink(new_dir);
+        inc_nlink(old_dir);
+      }
+    }
+    return 0;
+  }
+
+  if (dst)
+    vtfs_release_replaced(info, new_inode, dst);
+
+  if (dst_is_dir) {
+    // new_dir trades one subdirectory for another, old_dir loses one
+    drop_nlink(old_dir);
+  } else if (src_is_dir && old_dir != new_dir) {
+    drop_nlink(old_dir);
+    inc_nlink(new_dir);
+  }
+
+  return 0;
+}
@@ -0,0 +1,79 @@
+#include <linux/capability.h>
+#include <linux/uaccess.h>
+
+#include "vtfs.h"
+#include "vtfs_ioctl.h"
+
+static long vtfs_ioctl_snapshot(struct super_block* sb, unsigned int cmd, void __user* argp) {
+  struct vtfs_snapshot_args args;
+
+  if (!capable(CAP_SYS_ADMIN))
+    return -EPERM;
+
+  if (copy_from_user(&args, argp, sizeof(args)))
+    return -EFAULT;
+
+  if (strnlen(args.name, sizeof(args.name)) == sizeof(args.name))
+    return -ENAMETOOLONG;
+
+  if (cmd == VTFS_IOC_SNAP_CREATE)
+    return vtfs_snapshot_create(sb, args.name);
+  return vtfs_snapshot_delete(sb, args.name);
+}
+
+static long vtfs_ioctl_set_ttl(struct file* filp, void __user* argp) {
+  struct inode* inode = file_inode(filp);
+  struct vtfs_ttl_args args;
+
+  if (!S_ISREG(inode->i_mode))
+    return -ENOTTY;
+
+  if (!(filp->f_mode & FMODE_WRITE))
+    return -EBADF;
+
+  if (copy_from_user(&args, argp, sizeof(args)))
+    return -EFAULT;
+
+  return vtfs_cache_set_ttl(inode->i_sb->s_fs_info, inode, args.seconds);
+}
+
+static long vtfs_ioctl_usage(struct file* filp, void __user* argp) {
+  struct inode* inode = file_inode(filp);
+  struct vtfs_dir* dir = vtfs_get_dir(inode->i_sb, inode);
+  struct vtfs_usage_args args;
+  struct vtfs_usage usage;
+
+  if (!S_ISDIR(inode->i_mode))
+    return -ENOTDIR;
+
+  if (!dir || !inode->i_sb->s_fs_info)
+    return -ENOENT;
+
+  vtfs_usage_read(inode->i_sb->s_fs_info, dir, &usage);
+  args.bytes = usage.bytes;
+  args.files = usage.files;
+  args.dirs = usage.dirs;
+
+  return copy_to_user(argp, &args, sizeof(args)) ? -EFAULT : 0;
+}
+
+long vtfs_ioctl(struct file* filp, unsigned int cmd, unsigned long arg) {
+  struct super_block* sb = file_inode(filp)->i_sb;
+  void __user* argp = (void __user*)arg;
+
+  switch (cmd) {
+    case VTFS_IOC_SNAP_CREATE:
+    case VTFS_IOC_SNAP_DELETE:
+      return vtfs_ioctl_snapshot(sb, cmd, argp);
+    case VTFS_IOC_SET_TTL:
+      return vtfs_ioctl_set_ttl(filp, argp);
+    case VTFS_IOC_BATCH:
+      if (!S_ISDIR(file_inode(filp)->i_mode))
+        return -ENOTDIR;
+      return vtfs_batch(filp, argp);
+    case VTFS_IOC_USAGE:
+      return vtfs_ioctl_usage(filp, argp);
+    default:
+      return -ENOTTY;
+  }
+}
@@ -7,16 +7,26 @@ const struct inode_operations vtfs_inode_ops = {
     .mkdir = vtfs_mkdir,
     .rmdir = vtfs_rmdir,
     .link = vtfs_link,
+    .rename = vtfs_rename,
 };
 
 const struct file_operations vtfs_dir_ops = {
     .owner = THIS_MODULE,
     .iterate_shared = vtfs_iterate,
+    .unlocked_ioctl = vtfs_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
 };
 
 const struct file_operations vtfs_file_ops = {
     .owner = THIS_MODULE,
     .open = vtfs_open,
-    .read = vtfs_read,
-    .write = vtfs_write,
+    .read_iter = vtfs_read_iter,
+    .write_iter = vtfs_write_iter,
+    .unlocked_ioctl = vtfs_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+};
+
+const struct super_operations vtfs_super_ops = {
+    .show_options = vtfs_show_options,
+    .show_stats = vtfs_show_stats,
 };
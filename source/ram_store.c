@@ -1,32 +1,26 @@
+#include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/string.h>
+#include <linux/xarray.h>
 
 #include "vtfs.h"
-#include "vtfs_ram_store.h"
 
-// find any file with this ino
-struct vtfs_file* vtfs_find_file_by_ino(struct vtfs_dir* dir, ino_t ino) {
-  struct vtfs_file* file;
+// Creates run under different directory locks, in batch ioctls and snapshot
+// clones, so numbers come from atomics and are never handed out twice.
+ino_t vtfs_alloc_ino(struct vtfs_fs_info* info) {
+  return atomic64_inc_return(&info->next_ino) - 1;
+}
 
-  if (!dir)
-    return NULL;
+u32 vtfs_alloc_generation(struct vtfs_fs_info* info) {
+  return (u32)atomic_inc_return(&info->next_generation) - 1;
+}
 
-  down_read(&dir->sem);
-  list_for_each_entry(file, &dir->files, list) {
-    if (file->ino == ino) {
-      up_read(&dir->sem);
-      return file;
-    }
-    if (file->dir_data) {
-      struct vtfs_file* found = vtfs_find_file_by_ino(file->dir_data, ino);
-      if (found) {
-        up_read(&dir->sem);
-        return found;
-      }
-    }
-  }
-  up_read(&dir->sem);
-  return NULL;
+// a single path component that fits into vtfs_file.name
+bool vtfs_name_ok(const char* name) {
+  size_t len = strnlen(name, VTFS_MAX_NAME);
+
+  return len && len < VTFS_MAX_NAME && !strchr(name, '/') && strcmp(name, ".") &&
+         strcmp(name, "..");
 }
 
 // find file in dir directory only
@@ -43,12 +37,18 @@ struct vtfs_file* vtfs_find_file(struct vtfs_dir* dir, const char* name) {
   return NULL;
 }
 
+// new entries belong to the owner of dir_inode (root without one)
 struct vtfs_file* vtfs_create_file(
-    struct vtfs_dir* dir, const char* name, umode_t mode, ino_t ino
+    struct vtfs_fs_info* info,
+    struct vtfs_dir* dir,
+    const struct inode* dir_inode,
+    const char* name,
+    umode_t mode,
+    ino_t ino
 ) {
   struct vtfs_file* file;
 
-  if (!dir || !name || strlen(name) >= VTFS_MAX_NAME)
+  if (!info || !dir || !name || strlen(name) >= VTFS_MAX_NAME)
     return NULL;
 
   if (vtfs_find_file(dir, name))
@@ -59,9 +59,14 @@ struct vtfs_file* vtfs_create_file(
     return NULL;
 
   INIT_LIST_HEAD(&file->list);
+  INIT_LIST_HEAD(&file->links);
   file->ino = ino;
   file->mode = mode;
   file->nlink = 1;
+  file->generation = vtfs_alloc_generation(info);
+  file->uid = dir_inode ? dir_inode->i_uid : GLOBAL_ROOT_UID;
+  file->gid = dir_inode ? dir_inode->i_gid : GLOBAL_ROOT_GID;
+  file->parent = dir;
 
   strscpy(file->name, name, VTFS_MAX_NAME);
 
@@ -73,12 +78,48 @@ struct vtfs_file* vtfs_create_file(
     }
     INIT_LIST_HEAD(&file->dir_data->files);
     init_rwsem(&file->dir_data->sem);
+    file->dir_data->ino = ino;
+    file->dir_data->parent = dir;
+  }
+
+  // never replace another inode's entry
+  if (xa_insert(&info->inodes, ino, file, GFP_KERNEL)) {
+    kfree(file->dir_data);
+    kfree(file);
+    return NULL;
   }
 
   list_add_tail(&file->list, &dir->files);
   return file;
 }
 
+// Called once an entry is off its directory list and before it is freed: the
+// index moves to another name of the same inode, or drops the inode entirely.
+// The other names are on file->links, no tree walk is needed.
+void vtfs_index_forget(struct vtfs_fs_info* info, struct vtfs_file* file, unsigned int nlink) {
+  struct vtfs_file* other = NULL;
+
+  if (!info)
+    return;
+
+  spin_lock(&info->links_lock);
+  if (nlink && !list_empty(&file->links))
+    other = list_first_entry(&file->links, struct vtfs_file, links);
+  list_del_init(&file->links);
+
+  // the index and the subtree usage change together, see vtfs_usage_charge
+  write_lock(&info->usage_lock);
+  if (nlink == 0)
+    xa_erase(&info->inodes, file->ino);
+  else if (xa_load(&info->inodes, file->ino) != file)
+    other = NULL;
+  else
+    xa_cmpxchg(&info->inodes, file->ino, file, other, GFP_ATOMIC);
+  vtfs_usage_unlink(info, file, other);
+  write_unlock(&info->usage_lock);
+  spin_unlock(&info->links_lock);
+}
+
 int vtfs_remove_file(struct vtfs_dir* dir, const char* name) {
   struct vtfs_file* file;
 
@@ -96,7 +137,7 @@ int vtfs_remove_file(struct vtfs_dir* dir, const char* name) {
   up_write(&dir->sem);
 
   if (file->dir_data) {
-    vtfs_cleanup_dir(file->dir_data);
+    vtfs_cleanup_dir_async(file->dir_data);
     kfree(file->dir_data);
   }
 
@@ -107,67 +148,107 @@ int vtfs_remove_file(struct vtfs_dir* dir, const char* name) {
   return 0;
 }
 
-void vtfs_cleanup_dir(struct vtfs_dir* dir) {
-  struct vtfs_file *file, *tmp;
-
-  struct list_head data_list;
-  struct data_ptr_entry *data_entry, *data_tmp;
-  bool found;
+// false if the key was already seen (or could not be recorded, then we leak
+// rather than risk a double free)
+static bool vtfs_first_sight(struct xarray* seen, unsigned long key) {
+  int err = xa_insert(seen, key, xa_mk_value(0), GFP_KERNEL);
 
-  if (!dir)
-    return;
+  if (err == -ENOMEM)
+    pr_warn("[vtfs] out of memory on teardown, leaking a buffer\n");
+  return err == 0;
+}
 
-  INIT_LIST_HEAD(&data_list);
+// Frees every entry on the list, flattening subdirectories into the same list
+// instead of recursing, so depth costs neither stack nor time.
+//
+// With info == NULL the whole mount is going away: every buffer is freed once,
+// whoever shares it (hard links, snapshots). Otherwise only a subtree goes:
+// each inode drops its index entry and releases its reference to the data, so
+// buffers still used elsewhere survive. Inodes with a single name and no
+// snapshot sharing skip the bookkeeping.
+void vtfs_free_entries(struct vtfs_fs_info* info, struct list_head* entries) {
+  struct vtfs_file* file;
+  struct xarray seen, seen_ino;
 
-  down_read(&dir->sem);
-  list_for_each_entry(file, &dir->files, list) {
-    if (!file->data)
-      continue;
-
-    found = false;
-    list_for_each_entry(data_entry, &data_list, list) {
-      if (data_entry->data == file->data) {
-        found = true;
-        break;
-      }
-    }
+  xa_init(&seen);
+  xa_init(&seen_ino);
 
-    if (!found) {
-      data_entry = kmalloc(sizeof(*data_entry), GFP_KERNEL);
-      if (data_entry) {
-        data_entry->data = file->data;
-        INIT_LIST_HEAD(&data_entry->list);
-        list_add_tail(&data_entry->list, &data_list);
-      }
-    }
-  }
-  up_read(&dir->sem);
+  while (!list_empty(entries)) {
+    bool single;
 
-  down_write(&dir->sem);
-  list_for_each_entry_safe(file, tmp, &dir->files, list) {
+    file = list_first_entry(entries, struct vtfs_file, list);
     list_del(&file->list);
 
     if (file->dir_data) {
-      vtfs_cleanup_dir(file->dir_data);
+      list_splice_tail_init(&file->dir_data->files, entries);
       kfree(file->dir_data);
-      file->dir_data = NULL;
     }
 
-    file->data = NULL;
-    file->data_size = 0;
+    if (info) {
+      spin_lock(&info->links_lock);
+      list_del_init(&file->links);
+      xa_erase(&info->inodes, file->ino);
+      spin_unlock(&info->links_lock);
+    }
+
+    single = file->nlink <= 1 && !(file->flags & VTFS_F_COW);
+
+    if (file->data) {
+      unsigned long key = info ? file->ino : (unsigned long)file->data;
+
+      if (single || vtfs_first_sight(&seen, key)) {
+        if (info)
+          vtfs_data_free(info, file->data, file->data_size);
+        else
+          kfree(file->data);
+      }
+    }
+
+    if ((file->shm || file->cnode) && (single || vtfs_first_sight(&seen_ino, file->ino))) {
+      vtfs_shm_put(info, file->ino, file->shm);
+      vtfs_cache_forget(info, file->cnode);
+    }
 
     kfree(file);
+    cond_resched();
   }
+
+  xa_destroy(&seen);
+  xa_destroy(&seen_ino);
+}
+
+// the last name of an inode is gone: release what the inode owns
+void vtfs_release_contents(struct vtfs_fs_info* info, struct vtfs_file* file) {
+  vtfs_data_free_async(info, file->data, file->data_size);
+  vtfs_shm_put(info, file->ino, file->shm);
+  vtfs_cache_forget(info, file->cnode);
+}
+
+void vtfs_cleanup_dir(struct vtfs_dir* dir) {
+  LIST_HEAD(entries);
+
+  if (!dir)
+    return;
+
+  down_write(&dir->sem);
+  list_splice_init(&dir->files, &entries);
   up_write(&dir->sem);
 
-  list_for_each_entry_safe(data_entry, data_tmp, &data_list, list) {
-    void* data_ptr = data_entry->data;
-    list_del(&data_entry->list);
-    kfree(data_entry);
+  vtfs_free_entries(NULL, &entries);
+}
 
-    if (data_ptr)
-      kfree(data_ptr);
-  }
+// drop everything below dir while the rest of the mount stays in use
+void vtfs_free_subtree(struct vtfs_fs_info* info, struct vtfs_dir* dir) {
+  LIST_HEAD(entries);
+
+  if (!dir)
+    return;
+
+  down_write(&dir->sem);
+  list_splice_init(&dir->files, &entries);
+  up_write(&dir->sem);
+
+  vtfs_free_entries(info, &entries);
 }
 
 struct vtfs_dir* vtfs_get_dir(struct super_block* sb, struct inode* inode) {
@@ -184,7 +265,7 @@ struct vtfs_dir* vtfs_get_dir(struct super_block* sb, struct inode* inode) {
   if (inode->i_ino == VTFS_ROOT_INO)
     return &info->root_dir;
 
-  file = vtfs_find_file_by_ino(&info->root_dir, inode->i_ino);
+  file = xa_load(&info->inodes, inode->i_ino);
   if (file && S_ISDIR(file->mode))
     return file->dir_data;
 
@@ -201,78 +282,44 @@ struct vtfs_file* vtfs_get_file_by_inode(struct inode* inode) {
   if (!info)
     return NULL;
 
-  return vtfs_find_file_by_ino(&info->root_dir, inode->i_ino);
+  return xa_load(&info->inodes, inode->i_ino);
 }
 
-void vtfs_update_nlink_all(struct vtfs_dir* dir, ino_t ino, unsigned int nlink) {
-  struct vtfs_file* file;
-
-  if (!dir)
-    return;
-
-  down_write(&dir->sem);
-  list_for_each_entry(file, &dir->files, list) {
-    if (file->ino == ino)
-      file->nlink = nlink;
-  }
-  up_write(&dir->sem);
-
-  down_read(&dir->sem);
-  list_for_each_entry(file, &dir->files, list) {
-    if (file->dir_data)
-      vtfs_update_nlink_all(file->dir_data, ino, nlink);
-  }
-  up_read(&dir->sem);
-}
-
-void vtfs_update_data_all(
-    struct vtfs_dir* dir, ino_t ino, char* old_data, char* new_data, size_t new_size
-) {
-  struct vtfs_file* file;
-
-  if (!dir)
-    return;
-
-  down_write(&dir->sem);
-  list_for_each_entry(file, &dir->files, list) {
-    if (file->ino == ino) {
-      file->data_size = new_size;
-
-      if (file->data == old_data)
-        file->data = new_data;
+// The indexed name and the other names on its links ring. Index changes and
+// ring removals both happen under links_lock, so every name stays alive.
+void vtfs_update_nlink_all(struct vtfs_fs_info* info, ino_t ino, unsigned int nlink) {
+  struct vtfs_file *file, *other;
+
+  spin_lock(&info->links_lock);
+  file = xa_load(&info->inodes, ino);
+  if (file) {
+    file->nlink = nlink;
+    list_for_each_entry(other, &file->links, links) {
+      other->nlink = nlink;
     }
   }
-  up_write(&dir->sem);
-
-  down_read(&dir->sem);
-  list_for_each_entry(file, &dir->files, list) {
-    if (file->dir_data)
-      vtfs_update_data_all(file->dir_data, ino, old_data, new_data, new_size);
-  }
-  up_read(&dir->sem);
+  spin_unlock(&info->links_lock);
 }
 
-void vtfs_remove_all_by_ino(struct vtfs_dir* dir, ino_t ino) {
-  struct vtfs_file* file;
-  struct vtfs_file* tmp;
+static void vtfs_update_data(struct vtfs_file* file, char* old_data, char* new_data, size_t new_size) {
+  file->data_size = new_size;
 
-  if (!dir)
-    return;
-
-  down_write(&dir->sem);
-  list_for_each_entry_safe(file, tmp, &dir->files, list) {
-    if (file->ino == ino) {
-      list_del(&file->list);
-      kfree(file);
-    }
-  }
-  up_write(&dir->sem);
+  if (file->data == old_data)
+    file->data = new_data;
+}
 
-  down_read(&dir->sem);
-  list_for_each_entry(file, &dir->files, list) {
-    if (file->dir_data) {
-      vtfs_remove_all_by_ino(file->dir_data, ino);
+void vtfs_update_data_all(
+    struct vtfs_fs_info* info, ino_t ino, char* old_data, char* new_data, size_t new_size
+) {
+  struct vtfs_file *file, *other;
+
+  spin_lock(&info->links_lock);
+  file = xa_load(&info->inodes, ino);
+  if (file) {
+    vtfs_update_data(file, old_data, new_data, new_size);
+    list_for_each_entry(other, &file->links, links) {
+      vtfs_update_data(other, old_data, new_data, new_size);
     }
   }
-  up_read(&dir->sem);
+  spin_unlock(&info->links_lock);
 }
@@ -0,0 +1,87 @@
+#include <linux/llist.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include "vtfs.h"
+
+// Deferred freeing: umount, rmdir of big trees and unlink of big files return
+// right away and memory goes back in the background.
+
+struct vtfs_teardown {
+  struct work_struct work;
+  struct list_head entries;
+};
+
+static struct workqueue_struct* vtfs_reclaim_wq;
+
+// large buffers are chained through their own first bytes, no allocation needed
+static LLIST_HEAD(vtfs_free_list);
+
+static void vtfs_free_data_work(struct work_struct* work) {
+  struct llist_node *node, *next;
+
+  llist_for_each_safe(node, next, llist_del_all(&vtfs_free_list)) {
+    kfree(node);
+    cond_resched();
+  }
+}
+
+static DECLARE_WORK(vtfs_free_work, vtfs_free_data_work);
+
+static void vtfs_teardown_work(struct work_struct* work) {
+  struct vtfs_teardown* td = container_of(work, struct vtfs_teardown, work);
+
+  vtfs_free_entries(NULL, &td->entries);
+  kfree(td);
+}
+
+void vtfs_cleanup_dir_async(struct vtfs_dir* dir) {
+  struct vtfs_teardown* td;
+
+  if (!dir)
+    return;
+
+  td = kmalloc(sizeof(*td), GFP_KERNEL);
+  if (!td) {
+    vtfs_cleanup_dir(dir);
+    return;
+  }
+
+  INIT_WORK(&td->work, vtfs_teardown_work);
+  INIT_LIST_HEAD(&td->entries);
+
+  down_write(&dir->sem);
+  list_splice_init(&dir->files, &td->entries);
+  up_write(&dir->sem);
+
+  if (list_empty(&td->entries)) {
+    kfree(td);
+    return;
+  }
+
+  queue_work(vtfs_reclaim_wq, &td->work);
+}
+
+void vtfs_data_free_async(struct vtfs_fs_info* info, char* data, size_t size) {
+  if (!data || vtfs_data_release(info, data))
+    return;
+
+  vtfs_data_forget(info, data, size);
+  if (size < VTFS_ASYNC_FREE_MIN) {
+    kfree(data);
+    return;
+  }
+
+  if (llist_add((struct llist_node*)data, &vtfs_free_list))
+    queue_work(vtfs_reclaim_wq, &vtfs_free_work);
+}
+
+int vtfs_reclaim_init(void) {
+  vtfs_reclaim_wq = alloc_workqueue("vtfs_reclaim", WQ_UNBOUND, 0);
+  return vtfs_reclaim_wq ? 0 : -ENOMEM;
+}
+
+// waits for everything still queued, called on module unload
+void vtfs_reclaim_exit(void) {
+  destroy_workqueue(vtfs_reclaim_wq);
+}
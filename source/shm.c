@@ -0,0 +1,166 @@
+#include <linux/file.h>
+#include <linux/highmem.h>
+#include <linux/ktime.h>
+#include <linux/pagemap.h>
+#include <linux/shmem_fs.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/xarray.h>
+
+#include "vtfs.h"
+
+// storage=shmem: file contents live in an unlinked shmem file per inode, so
+// cold data can be swapped out and is faulted back in on read.
+
+struct file* vtfs_shm_create(struct vtfs_fs_info* info, ino_t ino) {
+  struct file* shm;
+  int err;
+
+  shm = shmem_file_setup("vtfs-data", MAX_LFS_FILESIZE, VM_NORESERVE);
+  if (IS_ERR(shm))
+    return shm;
+
+  err = xa_err(xa_store(&info->shm_files, ino, shm, GFP_KERNEL));
+  if (err) {
+    fput(shm);
+    return ERR_PTR(err);
+  }
+  return shm;
+}
+
+// last link is gone
+void vtfs_shm_put(struct vtfs_fs_info* info, ino_t ino, struct file* shm) {
+  if (!shm)
+    return;
+
+  if (info)
+    xa_erase(&info->shm_files, ino);
+  fput(shm);
+}
+
+void vtfs_shm_truncate(struct file* shm) {
+  shmem_truncate_range(file_inode(shm), 0, (loff_t)-1);
+}
+
+static bool vtfs_shm_swapped(struct address_space* mapping, pgoff_t index) {
+  void* entry;
+
+  rcu_read_lock();
+  entry = xa_load(&mapping->i_pages, index);
+  rcu_read_unlock();
+
+  return xa_is_value(entry);
+}
+
+// nowait: only a folio that is already in memory and up to date, no swap-in
+static struct folio* vtfs_shm_folio(struct file* shm, pgoff_t index, bool nowait) {
+  struct folio* folio;
+
+  if (!nowait)
+    return shmem_read_folio(shm->f_mapping, index);
+
+  folio = filemap_get_folio(shm->f_mapping, index);
+  if (IS_ERR(folio))
+    return ERR_PTR(-EAGAIN);
+  if (!folio_test_uptodate(folio)) {
+    folio_put(folio);
+    return ERR_PTR(-EAGAIN);
+  }
+  return folio;
+}
+
+// read side: a page that had to come back from swap is counted as a swap-in
+static struct folio* vtfs_shm_read_folio(
+    struct vtfs_fs_info* info, struct file* shm, pgoff_t index, bool nowait
+) {
+  struct folio* folio;
+  u64 start;
+
+  if (nowait || !vtfs_shm_swapped(shm->f_mapping, index))
+    return vtfs_shm_folio(shm, index, nowait);
+
+  start = ktime_get_ns();
+  folio = shmem_read_folio(shm->f_mapping, index);
+  if (!IS_ERR(folio)) {
+    atomic64_inc(&info->swapins);
+    atomic64_add(ktime_get_ns() - start, &info->swapin_ns);
+  }
+  return folio;
+}
+
+ssize_t vtfs_shm_read(
+    struct vtfs_fs_info* info, struct file* shm, struct iov_iter* to, size_t len, loff_t pos,
+    bool nowait
+) {
+  size_t done = 0;
+
+  while (done < len) {
+    size_t off = offset_in_page(pos);
+    size_t chunk = min_t(size_t, len - done, PAGE_SIZE - off);
+    struct folio* folio = vtfs_shm_read_folio(info, shm, pos >> PAGE_SHIFT, nowait);
+    void* kaddr;
+    size_t copied;
+
+    if (IS_ERR(folio))
+      return done ? done : PTR_ERR(folio);
+
+    kaddr = kmap_local_folio(folio, offset_in_folio(folio, pos));
+    copied = copy_to_iter(kaddr, chunk, to);
+    kunmap_local(kaddr);
+    folio_mark_accessed(folio);
+    folio_put(folio);
+
+    done += copied;
+    pos += copied;
+    if (copied < chunk)
+      return done ? done : -EFAULT;
+  }
+  return done;
+}
+
+ssize_t vtfs_shm_write(
+    struct vtfs_fs_info* info, struct file* shm, struct iov_iter* from, size_t len, loff_t pos,
+    bool nowait
+) {
+  size_t done = 0;
+
+  while (done < len) {
+    size_t off = offset_in_page(pos);
+    size_t chunk = min_t(size_t, len - done, PAGE_SIZE - off);
+    struct folio* folio = vtfs_shm_folio(shm, pos >> PAGE_SHIFT, nowait);
+    void* kaddr;
+    size_t copied;
+
+    if (IS_ERR(folio))
+      return done ? done : PTR_ERR(folio);
+
+    kaddr = kmap_local_folio(folio, offset_in_folio(folio, pos));
+    copied = copy_from_iter(kaddr, chunk, from);
+    kunmap_local(kaddr);
+    // dirty so reclaim writes the page to swap instead of dropping it
+    folio_mark_dirty(folio);
+    folio_put(folio);
+
+    done += copied;
+    pos += copied;
+    if (copied < chunk)
+      return done ? done : -EFAULT;
+  }
+  return done;
+}
+
+u64 vtfs_shm_swapped_bytes(struct vtfs_fs_info* info) {
+  struct file* shm;
+  unsigned long ino;
+  u64 pages = 0;
+
+  // erase happens before fput, so holding the lock keeps every file alive;
+  // struct file is SLAB_TYPESAFE_BY_RCU, RCU alone would not
+  xa_lock(&info->shm_files);
+  xa_for_each(&info->shm_files, ino, shm) {
+    pages += READ_ONCE(SHMEM_I(file_inode(shm))->swapped);
+  }
+  xa_unlock(&info->shm_files);
+
+  return pages << PAGE_SHIFT;
+}
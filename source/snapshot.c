@@ -0,0 +1,368 @@
+#include <linux/dcache.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/xarray.h>
+
+#include "vtfs.h"
+#include "vtfs_ioctl.h"
+
+// A snapshot is a read-only copy of the tree under /.snapshots/<name>. Only the
+// entries are cloned; file contents stay shared with the live tree and the
+// first write on the live side moves it to a private buffer (see
+// vtfs_data_realloc). Deleting a snapshot frees only the buffers nobody else
+// references any more.
+
+struct vtfs_clone_dir {
+  struct list_head link;
+  struct vtfs_dir* src;
+  struct vtfs_dir* dst;
+};
+
+// drop cached dentries (usually negative ones) that would hide a change we made
+// behind the VFS' back
+static void vtfs_snapshot_invalidate(struct super_block* sb, const char* name) {
+  struct qstr dir_name = QSTR_INIT(VTFS_SNAPSHOT_DIR, sizeof(VTFS_SNAPSHOT_DIR) - 1);
+  struct qstr snap_name = QSTR_INIT(name, strlen(name));
+  struct dentry *snapdir, *child;
+
+  snapdir = d_hash_and_lookup(sb->s_root, &dir_name);
+  if (IS_ERR_OR_NULL(snapdir))
+    return;
+
+  if (d_really_is_negative(snapdir)) {
+    d_invalidate(snapdir);
+  } else {
+    child = d_hash_and_lookup(snapdir, &snap_name);
+    if (!IS_ERR_OR_NULL(child)) {
+      d_invalidate(child);
+      dput(child);
+    }
+  }
+  dput(snapdir);
+}
+
+static struct vtfs_dir* vtfs_snapshots_dir(struct vtfs_fs_info* info, bool create) {
+  struct vtfs_dir* root = &info->root_dir;
+  struct vtfs_file* file;
+  bool created = false;
+
+  down_write(&root->sem);
+  file = vtfs_find_file(root, VTFS_SNAPSHOT_DIR);
+  if (!file && create) {
+    file = vtfs_create_file(info, root, NULL, VTFS_SNAPSHOT_DIR, S_IFDIR | 0555, vtfs_alloc_ino(info));
+    if (file) {
+      file->flags |= VTFS_F_HIDDEN;
+      file->dir_data->readonly = true;
+      created = true;
+    }
+  }
+  up_write(&root->sem);
+
+  if (!file)
+    return ERR_PTR(create ? -ENOMEM : -ENOENT);
+
+  // a user object took the name before the first snapshot
+  if (!(file->flags & VTFS_F_HIDDEN))
+    return ERR_PTR(-EEXIST);
+
+  if (created)
+    inc_nlink(d_inode(info->sb->s_root));
+
+  return file->dir_data;
+}
+
+static struct vtfs_file* vtfs_alloc_snapshot_entry(const char* name, umode_t mode) {
+  struct vtfs_file* file = kzalloc(sizeof(*file), GFP_KERNEL);
+
+  if (!file)
+    return NULL;
+
+  INIT_LIST_HEAD(&file->list);
+  INIT_LIST_HEAD(&file->links);
+  file->mode = mode;
+  file->nlink = 1;
+  file->flags = VTFS_F_SNAPSHOT;
+  strscpy(file->name, name, VTFS_MAX_NAME);
+
+  if (S_ISDIR(mode)) {
+    file->dir_data = kzalloc(sizeof(struct vtfs_dir), GFP_KERNEL);
+    if (!file->dir_data) {
+      kfree(file);
+      return NULL;
+    }
+    INIT_LIST_HEAD(&file->dir_data->files);
+    init_rwsem(&file->dir_data->sem);
+    file->dir_data->readonly = true;
+  }
+  return file;
+}
+
+// Clones one entry into dst. Names of the same live inode map to one snapshot
+// inode through `links`, so hard links stay hard links and the data reference
+// is taken once per inode.
+static struct vtfs_file* vtfs_clone_entry(
+    struct vtfs_fs_info* info, struct vtfs_file* src, struct vtfs_dir* dst, struct xarray* links
+) {
+  struct vtfs_file *clone, *first = NULL;
+
+  clone = vtfs_alloc_snapshot_entry(src->name, src->mode);
+  if (!clone)
+    return NULL;
+
+  if (src->nlink > 1)
+    first = xa_load(links, src->ino);
+
+  clone->nlink = src->nlink;
+  clone->uid = src->uid;
+  clone->gid = src->gid;
+  clone->parent = dst;
+  clone->data = src->data;
+  clone->data_size = src->data_size;
+
+  if (first) {
+    clone->ino = first->ino;
+    clone->generation = first->generation;
+    clone->flags |= first->flags & VTFS_F_COW;
+    spin_lock(&info->links_lock);
+    list_add_tail(&clone->links, &first->links);
+    spin_unlock(&info->links_lock);
+  } else {
+    clone->ino = vtfs_alloc_ino(info);
+    clone->generation = vtfs_alloc_generation(info);
+
+    if (xa_insert(&info->inodes, clone->ino, clone, GFP_KERNEL))
+      goto err;
+
+    if (src->nlink > 1 && xa_err(xa_store(links, src->ino, clone, GFP_KERNEL))) {
+      xa_erase(&info->inodes, clone->ino);
+      goto err;
+    }
+
+    if (src->data) {
+      if (vtfs_data_share(info, src->data)) {
+        xa_erase(&info->inodes, clone->ino);
+        xa_erase(links, src->ino);
+        goto err;
+      }
+      clone->flags |= VTFS_F_COW;
+    }
+  }
+
+  if (src->data)
+    src->flags |= VTFS_F_COW;
+
+  if (clone->dir_data) {
+    clone->dir_data->ino = clone->ino;
+    clone->dir_data->parent = dst;
+  }
+
+  list_add_tail(&clone->list, &dst->files);
+  return clone;
+
+err:
+  kfree(clone->dir_data);
+  kfree(clone);
+  return NULL;
+}
+
+// Breadth-first, so tree depth costs no stack. Runs with the filesystem
+// frozen and costs O(entries) of the whole tree; *count gets the number of
+// entries cloned.
+static int vtfs_clone_tree(struct vtfs_fs_info* info, struct vtfs_dir* snap_root, unsigned long* count) {
+  LIST_HEAD(queue);
+  struct vtfs_clone_dir *work, *tmp;
+  struct xarray links;
+  int err = 0;
+
+  work = kmalloc(sizeof(*work), GFP_KERNEL);
+  if (!work)
+    return -ENOMEM;
+
+  xa_init(&links);
+  work->src = &info->root_dir;
+  work->dst = snap_root;
+  list_add_tail(&work->link, &queue);
+
+  while (!err && !list_empty(&queue)) {
+    struct vtfs_file* file;
+
+    work = list_first_entry(&queue, struct vtfs_clone_dir, link);
+    list_del(&work->link);
+
+    down_read(&work->src->sem);
+    list_for_each_entry(file, &work->src->files, list) {
+      struct vtfs_file* clone;
+      struct vtfs_clone_dir* sub;
+
+      if (file->flags & VTFS_F_HIDDEN)
+        continue;
+
+      clone = vtfs_clone_entry(info, file, work->dst, &links);
+      if (!clone) {
+        err = -ENOMEM;
+        break;
+      }
+      (*count)++;
+
+      if (!clone->dir_data)
+        continue;
+
+      sub = kmalloc(sizeof(*sub), GFP_KERNEL);
+      if (!sub) {
+        err = -ENOMEM;
+        break;
+      }
+      sub->src = file->dir_data;
+      sub->dst = clone->dir_data;
+      list_add_tail(&sub->link, &queue);
+    }
+    up_read(&work->src->sem);
+
+    kfree(work);
+    cond_resched();
+  }
+
+  list_for_each_entry_safe(work, tmp, &queue, link) {
+    kfree(work);
+  }
+  xa_destroy(&links);
+  return err;
+}
+
+static void vtfs_snapshot_free(struct vtfs_fs_info* info, struct vtfs_file* snap) {
+  vtfs_free_subtree(info, snap->dir_data);
+  xa_erase(&info->inodes, snap->ino);
+  kfree(snap->dir_data);
+  kfree(snap);
+}
+
+int vtfs_snapshot_create(struct super_block* sb, const char* name) {
+  struct vtfs_fs_info* info = sb->s_fs_info;
+  struct vtfs_dir* snapdir;
+  struct vtfs_file* snap;
+  unsigned long entries = 0;
+  u64 frozen_ns;
+  int err;
+
+  if (!info)
+    return -ENOENT;
+
+  if (!vtfs_name_ok(name))
+    return -EINVAL;
+
+  // shmem backed files have no shareable buffer to copy on write
+  if (info->storage != VTFS_STORAGE_RAM)
+    return -EOPNOTSUPP;
+
+  mutex_lock(&info->snap_lock);
+
+  snapdir = vtfs_snapshots_dir(info, true);
+  if (IS_ERR(snapdir)) {
+    err = PTR_ERR(snapdir);
+    goto out_unlock;
+  }
+
+  down_read(&snapdir->sem);
+  snap = vtfs_find_file(snapdir, name);
+  up_read(&snapdir->sem);
+  if (snap) {
+    err = -EEXIST;
+    goto out_unlock;
+  }
+
+  snap = vtfs_alloc_snapshot_entry(name, S_IFDIR | 0555);
+  if (!snap) {
+    err = -ENOMEM;
+    goto out_unlock;
+  }
+  snap->ino = vtfs_alloc_ino(info);
+  snap->generation = vtfs_alloc_generation(info);
+  snap->parent = snapdir;
+  snap->dir_data->ino = snap->ino;
+  snap->dir_data->parent = snapdir;
+
+  err = xa_insert(&info->inodes, snap->ino, snap, GFP_KERNEL);
+  if (err) {
+    kfree(snap->dir_data);
+    kfree(snap);
+    goto out_unlock;
+  }
+
+  // Writers are held off at the VFS level for the point in time we copy.
+  // Known limitation: the whole mount stays frozen while every entry is
+  // cloned, so all writers stall for O(entries); the pause is logged.
+  err = freeze_super(sb, FREEZE_HOLDER_KERNEL);
+  if (err) {
+    vtfs_snapshot_free(info, snap);
+    goto out_unlock;
+  }
+
+  frozen_ns = ktime_get_ns();
+  err = vtfs_clone_tree(info, snap->dir_data, &entries);
+  thaw_super(sb, FREEZE_HOLDER_KERNEL);
+  frozen_ns = ktime_get_ns() - frozen_ns;
+
+  if (err) {
+    vtfs_snapshot_free(info, snap);
+    goto out_unlock;
+  }
+
+  down_write(&snapdir->sem);
+  list_add_tail(&snap->list, &snapdir->files);
+  up_write(&snapdir->sem);
+
+  vtfs_snapshot_invalidate(sb, name);
+  pr_info(
+      "[vtfs] snapshot %s created: %lu entries, writes paused for %llu us\n",
+      name,
+      entries,
+      div_u64(frozen_ns, NSEC_PER_USEC)
+  );
+
+out_unlock:
+  mutex_unlock(&info->snap_lock);
+  return err;
+}
+
+int vtfs_snapshot_delete(struct super_block* sb, const char* name) {
+  struct vtfs_fs_info* info = sb->s_fs_info;
+  struct vtfs_dir* snapdir;
+  struct vtfs_file* snap;
+  int err = 0;
+
+  if (!info)
+    return -ENOENT;
+
+  if (!vtfs_name_ok(name))
+    return -EINVAL;
+
+  mutex_lock(&info->snap_lock);
+
+  snapdir = vtfs_snapshots_dir(info, false);
+  if (IS_ERR(snapdir)) {
+    err = PTR_ERR(snapdir);
+    goto out_unlock;
+  }
+
+  down_write(&snapdir->sem);
+  snap = vtfs_find_file(snapdir, name);
+  if (snap)
+    list_del(&snap->list);
+  up_write(&snapdir->sem);
+
+  if (!snap) {
+    err = -ENOENT;
+    goto out_unlock;
+  }
+
+  vtfs_snapshot_invalidate(sb, name);
+  vtfs_snapshot_free(info, snap);
+  pr_info("[vtfs] snapshot %s deleted\n", name);
+
+out_unlock:
+  mutex_unlock(&info->snap_lock);
+  return err;
+}
@@ -0,0 +1,134 @@
+#include <linux/lockdep.h>
+#include <linux/spinlock.h>
+
+#include "vtfs.h"
+
+// Subtree usage: every directory keeps the totals of everything below it and
+// each change is pushed up the parent chain, so reading the usage of any
+// subtree is O(1) and updating it is O(depth). The bytes of a hard linked file
+// are counted once, at the name the ino index points to (vtfs_file.charged);
+// every name of a regular file counts as a file.
+//
+// Parent links, names coming and going and charged moving to another name all
+// happen with usage_lock held for writing, so a chain never moves while it is
+// being walked. Writes only change the byte counts: they take usage_lock for
+// reading and add to the per-directory atomics, so writers in different files
+// do not serialize on the lock.
+
+// what one name adds to the usage of the directories above it
+static void vtfs_usage_of(const struct vtfs_file* file, struct vtfs_usage* usage) {
+  *usage = (struct vtfs_usage){};
+
+  // .snapshots and everything below it is left out
+  if (file->flags & (VTFS_F_HIDDEN | VTFS_F_SNAPSHOT))
+    return;
+
+  if (file->dir_data) {
+    vtfs_usage_read(NULL, file->dir_data, usage);
+    usage->dirs++;
+  } else if (S_ISREG(file->mode)) {
+    usage->files = 1;
+    usage->bytes = file->charged;
+  }
+}
+
+static void vtfs_usage_add(struct vtfs_dir* dir, const struct vtfs_usage* usage) {
+  for (; dir; dir = dir->parent) {
+    atomic64_add(usage->bytes, &dir->usage.bytes);
+    atomic64_add(usage->files, &dir->usage.files);
+    atomic64_add(usage->dirs, &dir->usage.dirs);
+  }
+}
+
+static void vtfs_usage_sub(struct vtfs_dir* dir, const struct vtfs_usage* usage) {
+  for (; dir; dir = dir->parent) {
+    atomic64_sub(usage->bytes, &dir->usage.bytes);
+    atomic64_sub(usage->files, &dir->usage.files);
+    atomic64_sub(usage->dirs, &dir->usage.dirs);
+  }
+}
+
+// a new name is on the parent's list
+void vtfs_usage_link(struct vtfs_fs_info* info, struct vtfs_file* file) {
+  struct vtfs_usage usage;
+
+  write_lock(&info->usage_lock);
+  vtfs_usage_of(file, &usage);
+  vtfs_usage_add(file->parent, &usage);
+  write_unlock(&info->usage_lock);
+}
+
+// The name is off its list; its bytes move to heir, the name the index points
+// to from now on (NULL with the last link). Called with usage_lock held for
+// writing, from vtfs_index_forget, so a concurrent vtfs_usage_charge sees
+// either the old or the new indexed name, never both.
+void vtfs_usage_unlink(struct vtfs_fs_info* info, struct vtfs_file* file, struct vtfs_file* heir) {
+  struct vtfs_usage usage;
+
+  lockdep_assert_held_write(&info->usage_lock);
+
+  vtfs_usage_of(file, &usage);
+  vtfs_usage_sub(file->parent, &usage);
+
+  if (heir && file->charged) {
+    struct vtfs_usage bytes = {.bytes = file->charged};
+
+    heir->charged = file->charged;
+    vtfs_usage_add(heir->parent, &bytes);
+  }
+  file->charged = 0;
+}
+
+// rename: the name, and a whole subtree below it, goes to dir
+void vtfs_usage_move(struct vtfs_fs_info* info, struct vtfs_file* file, struct vtfs_dir* dir) {
+  struct vtfs_usage usage;
+
+  write_lock(&info->usage_lock);
+  vtfs_usage_of(file, &usage);
+  vtfs_usage_sub(file->parent, &usage);
+
+  file->parent = dir;
+  if (file->dir_data)
+    WRITE_ONCE(file->dir_data->parent, dir);
+
+  vtfs_usage_add(dir, &usage);
+  write_unlock(&info->usage_lock);
+}
+
+// The file is size bytes long now. Callers hold the inode lock, as does
+// everyone removing a name of the inode, so the indexed name stays alive and
+// charges of one inode never race each other. charged only moves to another
+// name with its value, so an unchanged size needs no lock at all.
+void vtfs_usage_charge(struct vtfs_fs_info* info, ino_t ino, size_t size) {
+  struct vtfs_file* file;
+  struct vtfs_usage delta = {};
+
+  if (!info)
+    return;
+
+  file = xa_load(&info->inodes, ino);
+  if (!file || READ_ONCE(file->charged) == size)
+    return;
+
+  read_lock(&info->usage_lock);
+  file = xa_load(&info->inodes, ino);
+  if (file && S_ISREG(file->mode) && !(file->flags & VTFS_F_SNAPSHOT) && file->charged != size) {
+    if (size > file->charged) {
+      delta.bytes = size - file->charged;
+      vtfs_usage_add(file->parent, &delta);
+    } else {
+      delta.bytes = file->charged - size;
+      vtfs_usage_sub(file->parent, &delta);
+    }
+    WRITE_ONCE(file->charged, size);
+  }
+  read_unlock(&info->usage_lock);
+}
+
+// Without the lock, so the three values may be from slightly different moments
+// when files change meanwhile, like statfs.
+void vtfs_usage_read(struct vtfs_fs_info* info, struct vtfs_dir* dir, struct vtfs_usage* usage) {
+  usage->bytes = atomic64_read(&dir->usage.bytes);
+  usage->files = atomic64_read(&dir->usage.files);
+  usage->dirs = atomic64_read(&dir->usage.dirs);
+}
@@ -1,29 +1,294 @@
 #include "vtfs.h"
 
+#include <linux/ctype.h>
 #include <linux/fs.h>
 #include <linux/module.h>
+#include <linux/math64.h>
 #include <linux/mount.h>
+#include <linux/parser.h>
+#include <linux/percpu.h>
+#include <linux/random.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/string.h>
+
+enum {
+  Opt_mpol,
+  Opt_storage,
+  Opt_cache,
+  Opt_cache_size,
+  Opt_err,
+};
+
+static const match_table_t vtfs_tokens = {
+    {   Opt_mpol,    "mpol=%s"},
+    {Opt_storage, "storage=%s"},
+    {Opt_cache, "cache"},
+    {Opt_cache_size, "cache_size=%s"},
+    {    Opt_err,         NULL},
+};
+
+static const char* const vtfs_storage_names[] = {
+    [VTFS_STORAGE_RAM] = "ram",
+    [VTFS_STORAGE_SHMEM] = "shmem",
+};
+
+static const char* const vtfs_mpol_names[] = {
+    [VTFS_MPOL_DEFAULT] = "default",
+    [VTFS_MPOL_LOCAL] = "local",
+    [VTFS_MPOL_BIND] = "bind",
+    [VTFS_MPOL_INTERLEAVE] = "interleave",
+};
+
+// mpol=default|local|bind[:nodelist]|interleave[:nodelist], like tmpfs
+static int vtfs_parse_mpol(struct vtfs_fs_info* info, char* value) {
+  char* nodelist = strchr(value, ':');
+  int mode;
+
+  if (nodelist)
+    *nodelist++ = '\0';
+
+  mode = match_string(vtfs_mpol_names, ARRAY_SIZE(vtfs_mpol_names), value);
+  if (mode < 0)
+    return -EINVAL;
+
+  info->mpol = mode;
+  info->mpol_nodes = node_states[N_MEMORY];
+
+  if (!nodelist)
+    return 0;
+
+  if (mode != VTFS_MPOL_BIND && mode != VTFS_MPOL_INTERLEAVE)
+    return -EINVAL;
+
+  if (nodelist_parse(nodelist, info->mpol_nodes))
+    return -EINVAL;
+
+  if (nodes_empty(info->mpol_nodes) || !nodes_subset(info->mpol_nodes, node_states[N_MEMORY]))
+    return -EINVAL;
+
+  return 0;
+}
+
+// a nodelist may itself contain commas: "mpol=interleave:0,2,size=..."
+static char* vtfs_next_option(char** options) {
+  char* opt = *options;
+  char* rest = opt;
+
+  if (!opt || strncmp(opt, "mpol=", 5))
+    return strsep(options, ",");
+
+  for (;;) {
+    rest = strchr(rest, ',');
+    if (!rest) {
+      *options = NULL;
+      return opt;
+    }
+    if (!isdigit(rest[1])) {
+      *rest = '\0';
+      *options = rest + 1;
+      return opt;
+    }
+    rest++;
+  }
+}
+
+static int vtfs_parse_options(struct vtfs_fs_info* info, char* options) {
+  substring_t args[MAX_OPT_ARGS];
+  char* p;
+
+  info->mpol = VTFS_MPOL_DEFAULT;
+  info->mpol_nodes = node_states[N_MEMORY];
+  info->storage = VTFS_STORAGE_RAM;
+
+  if (!options)
+    return 0;
+
+  while ((p = vtfs_next_option(&options)) != NULL) {
+    char *value, *end;
+    int err;
+
+    if (!*p)
+      continue;
+
+    switch (match_token(p, vtfs_tokens, args)) {
+      case Opt_mpol:
+        value = match_strdup(&args[0]);
+        if (!value)
+          return -ENOMEM;
+        err = vtfs_parse_mpol(info, value);
+        kfree(value);
+        if (err) {
+          pr_err("[vtfs] bad mpol option: %s\n", p);
+          return err;
+        }
+        break;
+      case Opt_storage:
+        value = match_strdup(&args[0]);
+        if (!value)
+          return -ENOMEM;
+        err = match_string(vtfs_storage_names, ARRAY_SIZE(vtfs_storage_names), value);
+        kfree(value);
+        if (err < 0) {
+          pr_err("[vtfs] bad storage option: %s\n", p);
+          return -EINVAL;
+        }
+        info->storage = err;
+        break;
+      case Opt_cache:
+        info->cache = true;
+        break;
+      case Opt_cache_size:
+        // cache_size=64m, suffixes as for tmpfs size=; implies cache
+        value = match_strdup(&args[0]);
+        if (!value)
+          return -ENOMEM;
+        info->cache_budget = memparse(value, &end);
+        err = *end ? -EINVAL : 0;
+        kfree(value);
+        if (err) {
+          pr_err("[vtfs] bad cache_size option: %s\n", p);
+          return err;
+        }
+        info->cache = true;
+        break;
+      default:
+        // unknown options are ignored, older scripts pass leftovers like token=
+        break;
+    }
+  }
+
+  // evicting a file has to drop its data, shmem pages are swapped instead
+  if (info->cache && info->storage != VTFS_STORAGE_RAM) {
+    pr_err("[vtfs] cache works with storage=ram only\n");
+    return -EINVAL;
+  }
+
+  return 0;
+}
+
+static void vtfs_free_info(struct vtfs_fs_info* info) {
+  xa_destroy(&info->inodes);
+  xa_destroy(&info->data_refs);
+  xa_destroy(&info->shm_files);
+  free_percpu(info->mpol_rotor);
+  kfree(info->node_bytes);
+  kfree(info);
+}
+
+int vtfs_show_options(struct seq_file* m, struct dentry* root) {
+  struct vtfs_fs_info* info = root->d_sb->s_fs_info;
+
+  if (!info)
+    return 0;
+
+  if (info->storage != VTFS_STORAGE_RAM)
+    seq_printf(m, ",storage=%s", vtfs_storage_names[info->storage]);
+
+  if (info->cache_budget)
+    seq_printf(m, ",cache_size=%lu", info->cache_budget);
+  else if (info->cache)
+    seq_puts(m, ",cache");
+
+  if (info->mpol == VTFS_MPOL_DEFAULT)
+    return 0;
+
+  seq_printf(m, ",mpol=%s", vtfs_mpol_names[info->mpol]);
+  if (info->mpol == VTFS_MPOL_BIND || info->mpol == VTFS_MPOL_INTERLEAVE)
+    seq_printf(m, ":%*pbl", nodemask_pr_args(&info->mpol_nodes));
+  return 0;
+}
+
+// shows up in /proc/self/mountstats
+int vtfs_show_stats(struct seq_file* m, struct dentry* root) {
+  struct vtfs_fs_info* info = root->d_sb->s_fs_info;
+  int nid;
+
+  if (!info)
+    return 0;
+
+  seq_puts(m, "\n\tnode_bytes:");
+  for_each_node_state(nid, N_MEMORY) {
+    seq_printf(m, " N%d=%ld", nid, atomic_long_read(&info->node_bytes[nid]));
+  }
+
+  if (info->storage == VTFS_STORAGE_SHMEM) {
+    u64 swapins = atomic64_read(&info->swapins);
+    u64 swapin_ns = atomic64_read(&info->swapin_ns);
+
+    seq_printf(
+        m,
+        "\n\tswap: swapped_bytes=%llu swapins=%llu swapin_avg_ns=%llu",
+        vtfs_shm_swapped_bytes(info),
+        swapins,
+        swapins ? div64_u64(swapin_ns, swapins) : 0
+    );
+  }
+
+  if (info->cache) {
+    seq_printf(
+        m,
+        "\n\tcache: budget=%lu bytes=%ld hits=%lld misses=%lld evictions=%lld expired=%lld",
+        info->cache_budget,
+        atomic_long_read(&info->data_bytes),
+        atomic64_read(&info->cache_hits),
+        atomic64_read(&info->cache_misses),
+        atomic64_read(&info->cache_evictions),
+        atomic64_read(&info->cache_expired)
+    );
+  }
+  return 0;
+}
 
 static int vtfs_fill_super(struct super_block* sb, void* data, int silent) {
   struct vtfs_fs_info* info;
   struct inode* inode;
+  int err = -ENOMEM;
 
-  (void)data;
   (void)silent;
 
   info = kzalloc(sizeof(*info), GFP_KERNEL);
   if (!info)
     return -ENOMEM;
 
+  xa_init(&info->inodes);
+  xa_init(&info->data_refs);
+  mutex_init(&info->snap_lock);
+  rwlock_init(&info->usage_lock);
+  spin_lock_init(&info->links_lock);
+  xa_init(&info->shm_files);
+  vtfs_cache_init(info);
+  info->node_bytes = kcalloc(nr_node_ids, sizeof(*info->node_bytes), GFP_KERNEL);
+  info->mpol_rotor = alloc_percpu(int);
+  if (!info->node_bytes || !info->mpol_rotor) {
+    vtfs_free_info(info);
+    return -ENOMEM;
+  }
+
+  err = vtfs_parse_options(info, data);
+  if (err) {
+    vtfs_free_info(info);
+    return err;
+  }
+  err = -ENOMEM;
+
   INIT_LIST_HEAD(&info->root_dir.files);
   init_rwsem(&info->root_dir.sem);
-  info->next_ino = 200;
+  info->root_dir.ino = VTFS_ROOT_INO;
+  atomic64_set(&info->next_ino, 200);
+  atomic_set(&info->next_generation, get_random_u32());
   info->sb = sb;
 
   sb->s_fs_info = info;
   sb->s_magic = 0x56544653;
   sb->s_time_gran = 1;
+  // the limit generic_write_checks() enforces
+  sb->s_maxbytes = MAX_LFS_FILESIZE;
+  sb->s_op = &vtfs_super_ops;
+  sb->s_export_op = &vtfs_export_ops;
+  // only evictions make names go stale, other mounts skip the revalidate calls
+  if (info->cache)
+    sb->s_d_op = &vtfs_dentry_ops;
 
   inode = vtfs_get_inode(sb, NULL, S_IFDIR | 0777, VTFS_ROOT_INO);
   if (!inode)
@@ -37,15 +302,15 @@ static int vtfs_fill_super(struct super_block* sb, void* data, int silent) {
 
 err:
   vtfs_cleanup_dir(&info->root_dir);
-  kfree(info);
+  vtfs_free_info(info);
   sb->s_fs_info = NULL;
-  return -ENOMEM;
+  return err;
 }
 
 static struct dentry* vtfs_mount(
     struct file_system_type* fs_type, int flags, const char* dev_name, void* data
 ) {
-  return mount_nodev(fs_type, flags, NULL, vtfs_fill_super);
+  return mount_nodev(fs_type, flags, data, vtfs_fill_super);
 }
 
 static void vtfs_kill_sb(struct super_block* sb) {
@@ -56,8 +321,10 @@ static void vtfs_kill_sb(struct super_block* sb) {
 
   info = sb->s_fs_info;
   if (info) {
-    vtfs_cleanup_dir(&info->root_dir);
-    kfree(info);
+    vtfs_cache_destroy(info);
+    // the tree is handed over to the reclaim workqueue, umount does not wait for it
+    vtfs_cleanup_dir_async(&info->root_dir);
+    vtfs_free_info(info);
     sb->s_fs_info = NULL;
   }
 
@@ -72,12 +339,25 @@ static struct file_system_type vtfs_fs_type = {
 };
 
 static int __init vtfs_init(void) {
+  int err;
+
+  err = vtfs_reclaim_init();
+  if (err)
+    return err;
+
+  err = register_filesystem(&vtfs_fs_type);
+  if (err) {
+    vtfs_reclaim_exit();
+    return err;
+  }
+
   pr_info("[vtfs] VTFS loaded\n");
-  return register_filesystem(&vtfs_fs_type);
+  return 0;
 }
 
 static void __exit vtfs_exit(void) {
   unregister_filesystem(&vtfs_fs_type);
+  vtfs_reclaim_exit();
   pr_info("[vtfs] VTFS unloaded\n");
 }
 